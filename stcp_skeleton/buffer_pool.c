@@ -0,0 +1,207 @@
+/* buffer_pool.c--size-classed buffer pools with lock-free free stacks */
+
+#include "mysock_impl.h"
+
+
+/* room each class leaves beyond the data it is meant for, for the owner's
+ * own bookkeeping (a queue node, say)
+ */
+#define CLASS_SLACK 64
+
+static const struct
+{
+    size_t       size;          /* bytes a buffer of the class holds */
+    unsigned int per_chunk;     /* buffers allocated at a time */
+} size_classes[BUFFER_POOL_CLASSES] =
+{
+    { 256,                              64 },   /* ACKs, short writes */
+    { MAX_IP_PAYLOAD_LEN + CLASS_SLACK, 32 },   /* MTU-sized packets */
+    { MAX_PACKET_LEN + CLASS_SLACK,      4 }    /* the largest packets */
+};
+
+/* buffers follow their headers, padded to keep them aligned */
+#define HEADER_LEN ((sizeof(buffer_header_t) + 15) & ~(size_t) 15)
+#define STRIDE(size_class) (HEADER_LEN + size_classes[size_class].size)
+
+#define INDEX_MASK ((uint64_t) 0xffffffff)
+#define GENERATION ((uint64_t) 1 << 32)
+
+static buffer_header_t *buffer_at(const buffer_pool_t *pool, int size_class,
+                                  uint32_t index);
+static buffer_header_t *pop_free(buffer_pool_t *pool, int size_class);
+static void push_free(buffer_pool_t *pool, buffer_header_t *header);
+static bool_t grow_class(buffer_pool_t *pool, int size_class);
+
+
+void buffer_pool_init(buffer_pool_t *pool)
+{
+    assert(pool);
+
+    memset(pool, 0, sizeof(*pool));
+    PTHREAD_CALL(pthread_mutex_init(&pool->grow_lock, NULL));
+}
+
+void buffer_pool_destroy(buffer_pool_t *pool)
+{
+    int size_class;
+    uint32_t k;
+
+    assert(pool);
+
+    for (size_class = 0; size_class < BUFFER_POOL_CLASSES; ++size_class)
+    {
+        buffer_class_t *cls = &pool->classes[size_class];
+
+        for (k = 0; k < cls->num_chunks; ++k)
+            free(cls->chunks[k]);
+    }
+
+    PTHREAD_CALL(pthread_mutex_destroy(&pool->grow_lock));
+    memset(pool, 0, sizeof(*pool));
+}
+
+void *buffer_pool_alloc(buffer_pool_t *pool, size_t len)
+{
+    buffer_header_t *header = NULL;
+    int size_class;
+
+    assert(pool);
+
+    for (size_class = 0; size_class < BUFFER_POOL_CLASSES &&
+         len > size_classes[size_class].size; ++size_class)
+        ;
+
+    if (size_class < BUFFER_POOL_CLASSES)
+    {
+        while (!(header = pop_free(pool, size_class)) &&
+               grow_class(pool, size_class))
+            ;
+    }
+
+    if (!header)
+    {
+        /* too large for any class, or its class is as big as it gets */
+        header = (buffer_header_t *) malloc(HEADER_LEN + len);
+        assert(header);
+        header->pool = NULL;
+    }
+
+    return (char *) header + HEADER_LEN;
+}
+
+void buffer_pool_free(void *buf)
+{
+    buffer_header_t *header;
+
+    assert(buf);
+
+    header = (buffer_header_t *) ((char *) buf - HEADER_LEN);
+    if (header->pool)
+        push_free(header->pool, header);
+    else
+        free(header);
+}
+
+static buffer_header_t *buffer_at(const buffer_pool_t *pool, int size_class,
+                                  uint32_t index)
+{
+    unsigned int per_chunk = size_classes[size_class].per_chunk;
+    const buffer_class_t *cls = &pool->classes[size_class];
+
+    assert(index / per_chunk < cls->num_chunks);
+    return (buffer_header_t *) (cls->chunks[index / per_chunk] +
+                                (index % per_chunk) * STRIDE(size_class));
+}
+
+/* take the buffer on top of the class's free stack, or NULL if it is
+ * empty.  the exchange fails, and is retried, if another thread has pushed
+ * or popped since the top was read.
+ */
+static buffer_header_t *pop_free(buffer_pool_t *pool, int size_class)
+{
+    buffer_class_t *cls = &pool->classes[size_class];
+    uint64_t head = __atomic_load_n(&cls->free_head, __ATOMIC_ACQUIRE);
+
+    for (;;)
+    {
+        buffer_header_t *header;
+        uint32_t next;
+
+        if (!(head & INDEX_MASK))
+            return NULL;
+
+        header = buffer_at(pool, size_class, (uint32_t) (head & INDEX_MASK) - 1);
+        next = __atomic_load_n(&header->next_free, __ATOMIC_RELAXED);
+
+        if (__atomic_compare_exchange_n(&cls->free_head, &head,
+                                        (head & ~INDEX_MASK) + GENERATION + next,
+                                        TRUE, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_ACQUIRE))
+            return header;
+    }
+}
+
+static void push_free(buffer_pool_t *pool, buffer_header_t *header)
+{
+    buffer_class_t *cls = &pool->classes[header->size_class];
+    uint64_t head = __atomic_load_n(&cls->free_head, __ATOMIC_RELAXED);
+
+    assert(header->pool == pool);
+
+    do
+    {
+        __atomic_store_n(&header->next_free, (uint32_t) (head & INDEX_MASK),
+                         __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&cls->free_head, &head,
+                                          (head & ~INDEX_MASK) + GENERATION +
+                                          header->index + 1,
+                                          TRUE, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+/* add a chunk of buffers to the class's free stack.  returns FALSE if the
+ * class already has all the chunks it may have.
+ */
+static bool_t grow_class(buffer_pool_t *pool, int size_class)
+{
+    buffer_class_t *cls = &pool->classes[size_class];
+    unsigned int per_chunk = size_classes[size_class].per_chunk;
+    bool_t grown = TRUE;
+    unsigned int k;
+    char *chunk;
+
+    PTHREAD_CALL(pthread_mutex_lock(&pool->grow_lock));
+
+    /* another thread may have grown it while we waited */
+    if (__atomic_load_n(&cls->free_head, __ATOMIC_RELAXED) & INDEX_MASK)
+        goto done;
+
+    if (cls->num_chunks == BUFFER_POOL_MAX_CHUNKS)
+    {
+        grown = FALSE;
+        goto done;
+    }
+
+    chunk = (char *) malloc(per_chunk * STRIDE(size_class));
+    assert(chunk);
+
+    /* the chunk is in place before any of its buffers can be popped */
+    cls->chunks[cls->num_chunks] = chunk;
+    for (k = 0; k < per_chunk; ++k)
+    {
+        buffer_header_t *header =
+            (buffer_header_t *) (chunk + k * STRIDE(size_class));
+
+        header->pool = pool;
+        header->size_class = size_class;
+        header->index = cls->num_chunks * per_chunk + k;
+    }
+    cls->num_chunks++;
+
+    for (k = 0; k < per_chunk; ++k)
+        push_free(pool, (buffer_header_t *) (chunk + k * STRIDE(size_class)));
+
+done:
+    PTHREAD_CALL(pthread_mutex_unlock(&pool->grow_lock));
+    return grown;
+}
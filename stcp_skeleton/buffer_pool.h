@@ -0,0 +1,65 @@
+/* buffer_pool.h--size-classed buffer pools.
+ *
+ * a pool hands out buffers from a few size classes, each carved from
+ * chunks that are allocated the first time the class runs dry and kept
+ * until the pool is destroyed, so a steady flow of packets through it
+ * allocates nothing.  each class keeps its free buffers on a lock-free
+ * stack, so any thread may allocate or free without taking a lock; only
+ * growing a class does.  requests larger than the largest class, or made
+ * once a class has all the chunks it may have, fall back to malloc().
+ */
+
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include <stddef.h>
+#include <pthread.h>
+#include "mysock.h"   /* uint32_t, uint64_t, bool_t */
+
+
+#define BUFFER_POOL_CLASSES    3
+#define BUFFER_POOL_MAX_CHUNKS 16   /* per class */
+
+struct buffer_pool;
+
+/* precedes every buffer handed out */
+typedef struct
+{
+    struct buffer_pool *pool;       /* NULL if it came from malloc() */
+    int                 size_class;
+    uint32_t            index;      /* position in its class */
+    uint32_t            next_free;  /* free stack link: index + 1, or 0 */
+} buffer_header_t;
+
+typedef struct
+{
+    /* top of the free stack (index + 1, or 0 if empty) in the low half, and
+     * in the high half a count bumped by every push and pop, so that a
+     * thread whose view of the top is stale can't swap in a stale link
+     */
+    uint64_t  free_head;
+    uint32_t  num_chunks;
+    char     *chunks[BUFFER_POOL_MAX_CHUNKS];
+} buffer_class_t;
+
+typedef struct buffer_pool
+{
+    buffer_class_t  classes[BUFFER_POOL_CLASSES];
+    pthread_mutex_t grow_lock;
+} buffer_pool_t;
+
+
+void buffer_pool_init(buffer_pool_t *pool);
+
+/* release the pool's memory.  every buffer taken from it must have been
+ * freed, or at least be out of use.
+ */
+void buffer_pool_destroy(buffer_pool_t *pool);
+
+/* a buffer of at least len bytes, aligned for any type; never NULL */
+void *buffer_pool_alloc(buffer_pool_t *pool, size_t len);
+
+/* return a buffer from buffer_pool_alloc() to the pool it came from */
+void buffer_pool_free(void *buf);
+
+#endif  /* __BUFFER_POOL_H__ */
@@ -0,0 +1,86 @@
+/* byte_ring.c--fixed-size single-producer, single-consumer byte ring */
+
+#include "mysock_impl.h"
+
+
+void byte_ring_init(byte_ring_t *ring, size_t size)
+{
+    assert(ring && size > 0);
+
+    memset(ring, 0, sizeof(*ring));
+    ring->data = (uint8_t *) malloc(size);
+    assert(ring->data);
+    ring->size = size;
+}
+
+void byte_ring_destroy(byte_ring_t *ring)
+{
+    assert(ring);
+
+    free(ring->data);
+    memset(ring, 0, sizeof(*ring));
+}
+
+size_t byte_ring_write(byte_ring_t *ring, const void *src, size_t len)
+{
+    size_t tail = ring->tail;
+    size_t start, first_len;
+
+    assert(src || !len);
+    assert(!ring->closed);
+
+    len = MIN(len, byte_ring_space(ring));
+    if (len == 0)
+        return 0;
+
+    start = tail % ring->size;
+    first_len = MIN(len, ring->size - start);
+    memcpy(ring->data + start, src, first_len);
+    memcpy(ring->data, (const uint8_t *) src + first_len, len - first_len);
+
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+void byte_ring_close(byte_ring_t *ring)
+{
+    /* ordered after every write, so a consumer seeing it sees them too */
+    __atomic_store_n(&ring->closed, TRUE, __ATOMIC_RELEASE);
+}
+
+size_t byte_ring_read(byte_ring_t *ring, void *dst, size_t len)
+{
+    size_t head = ring->head;
+    size_t start, first_len;
+
+    assert(dst || !len);
+
+    len = MIN(len, byte_ring_count(ring));
+    if (len == 0)
+        return 0;
+
+    start = head % ring->size;
+    first_len = MIN(len, ring->size - start);
+    memcpy(dst, ring->data + start, first_len);
+    memcpy((uint8_t *) dst + first_len, ring->data, len - first_len);
+
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+size_t byte_ring_count(const byte_ring_t *ring)
+{
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+}
+
+size_t byte_ring_space(const byte_ring_t *ring)
+{
+    return ring->size - byte_ring_count(ring);
+}
+
+bool_t byte_ring_closed(const byte_ring_t *ring)
+{
+    return __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+}
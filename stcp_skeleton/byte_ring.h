@@ -0,0 +1,64 @@
+/* byte_ring.h--fixed-size single-producer, single-consumer byte ring.
+ *
+ * one thread writes bytes in at the tail and one other thread reads them
+ * out from the head.  a read or write of any length costs at most two
+ * copies, however the data was written, so taking part of what is there
+ * never moves the rest.  each end's position is written only by the
+ * thread that owns it and published to the other with release/acquire
+ * ordering, so the copies themselves need no lock.
+ *
+ * the ring never blocks; a thread that wants to wait for data or for room
+ * arranges that itself.
+ */
+
+#ifndef __BYTE_RING_H__
+#define __BYTE_RING_H__
+
+#include <stddef.h>
+#include "mysock.h"   /* uint8_t, bool_t */
+
+
+typedef struct
+{
+    uint8_t *data;
+    size_t   size;      /* bytes it holds when full */
+    size_t   head;      /* bytes ever read; written by the consumer */
+    size_t   tail;      /* bytes ever written; written by the producer */
+    bool_t   closed;    /* the producer has finished */
+
+    /* a thread asleep waiting for data, or for room; see
+     * _mysock_set_waiter()
+     */
+    bool_t   consumer_waiting;
+    bool_t   producer_waiting;
+} byte_ring_t;
+
+
+/* allocate a ring holding up to size bytes */
+void byte_ring_init(byte_ring_t *ring, size_t size);
+
+/* free the ring's buffer; harmless on a ring that was never initialised */
+void byte_ring_destroy(byte_ring_t *ring);
+
+/* producer: copy in as much of src as fits, returning how much that was */
+size_t byte_ring_write(byte_ring_t *ring, const void *src, size_t len);
+
+/* producer: say that nothing more will be written */
+void byte_ring_close(byte_ring_t *ring);
+
+/* consumer: copy out up to len bytes, returning how many there were */
+size_t byte_ring_read(byte_ring_t *ring, void *dst, size_t len);
+
+/* bytes waiting to be read, and room left to write.  each is exact only for
+ * the thread that would act on it: the count for the consumer, the room for
+ * the producer.
+ */
+size_t byte_ring_count(const byte_ring_t *ring);
+size_t byte_ring_space(const byte_ring_t *ring);
+
+/* TRUE once the producer has closed the ring.  a consumer seeing this and
+ * then finding the ring empty knows it will stay empty.
+ */
+bool_t byte_ring_closed(const byte_ring_t *ring);
+
+#endif  /* __BYTE_RING_H__ */
@@ -0,0 +1,40 @@
+/* congestion.c--congestion control module registry and shared helpers */
+
+#include <assert.h>
+#include <string.h>
+#include "mysock.h"
+#include "congestion.h"
+
+
+/* modules, indexed by MYSO_CONGESTION value */
+static const congestion_ops_t *const congestion_modules[MYSO_NUM_CC] =
+{
+    &congestion_newreno,    /* MYSO_CC_NEWRENO */
+    &congestion_cubic,      /* MYSO_CC_CUBIC */
+    &congestion_bbr         /* MYSO_CC_BBR */
+};
+
+
+const congestion_ops_t *congestion_lookup(int algorithm)
+{
+    assert(algorithm >= 0 && algorithm < MYSO_NUM_CC);
+    return congestion_modules[algorithm];
+}
+
+void congestion_init(congestion_t *cc, const congestion_ops_t *ops)
+{
+    assert(cc && ops);
+
+    cc->ops = ops;
+    cc->pacing_rate = 0;
+    memset(cc->priv, 0, sizeof(cc->priv));
+
+    ops->init(cc);
+    assert(cc->cwnd >= cc->mss);
+}
+
+uint32_t congestion_reno_ssthresh(const congestion_t *cc, uint32_t in_flight)
+{
+    assert(cc);
+    return (in_flight / 2 > 2 * cc->mss) ? in_flight / 2 : 2 * cc->mss;
+}
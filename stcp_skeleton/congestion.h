@@ -0,0 +1,114 @@
+/* congestion.h--pluggable congestion control for the STCP transport layer.
+ *
+ * the transport layer owns loss detection and recovery (fast retransmit,
+ * NewReno/PRR, retransmission timeouts); a congestion control module only
+ * decides how the window grows while things go well and how far it is cut
+ * when they don't.  each connection has one module, chosen with the
+ * MYSO_CONGESTION mysocket option.
+ */
+
+#ifndef __CONGESTION_H__
+#define __CONGESTION_H__
+
+#include "mysock.h"   /* uint32_t, bool_t */
+
+
+/* per-connection working space for the module, in 64-bit words */
+#define CONGESTION_PRIV_WORDS 24
+
+struct congestion_ops;
+
+/* congestion control state, kept in the transport layer's context */
+typedef struct
+{
+    uint32_t cwnd;          /* congestion window (bytes) */
+    uint32_t ssthresh;      /* slow start threshold (bytes) */
+    uint32_t pacing_rate;   /* bytes/s to pace at, or 0 to send at will */
+    uint32_t mss;           /* segment size the window is counted in */
+
+    const struct congestion_ops *ops;
+    uint64_t priv[CONGESTION_PRIV_WORDS];
+} congestion_t;
+
+/* what an ACK that delivered data tells the module.  sequence numbers are
+ * only meant for comparison with each other (e.g. to spot the end of a round
+ * trip).
+ */
+typedef struct
+{
+    uint64_t now;           /* current time (us) */
+    uint32_t acked;         /* bytes newly acknowledged cumulatively */
+    uint32_t sacked;        /* bytes newly acknowledged by SACK blocks */
+    uint32_t rtt;           /* round-trip sample (us), or 0 if none */
+    uint32_t in_flight;     /* bytes in flight before this ACK */
+    uint32_t ack_seq;       /* cumulative ACK just received */
+    uint32_t snd_nxt;       /* next sequence number to be sent */
+    bool_t   in_recovery;   /* the transport layer is recovering a loss */
+
+    /* delivery rate sample (draft-cheng-iccrg-delivery-rate-estimation):
+     * rate_delivered bytes reached the peer over rate_interval, measured
+     * from the most recently sent segment this ACK covers.
+     */
+    uint64_t delivered;         /* bytes delivered on the connection so far */
+    uint64_t prior_delivered;   /* delivered when that segment was sent */
+    uint32_t rate_delivered;
+    uint32_t rate_interval;     /* us, or 0 if this ACK gave no sample */
+    bool_t   rate_app_limited;  /* the application, not the network, was
+                                 * the bottleneck during the interval */
+} congestion_ack_t;
+
+typedef struct congestion_ops
+{
+    const char *name;
+
+    /* TRUE if the transport layer should steer cwnd during loss recovery
+     * (proportional rate reduction down to ssthresh, then cwnd = ssthresh).
+     * otherwise the module keeps setting cwnd itself in on_ack.
+     */
+    bool_t uses_prr;
+
+    /* set up cwnd, ssthresh and the module's private state.  cwnd holds
+     * the initial window on entry, and is kept if the module has no
+     * reason to change it (e.g. when switching modules mid-connection).
+     */
+    void (*init)(congestion_t *cc);
+
+    /* the peer acknowledged new data, cumulatively or by SACK */
+    void (*on_ack)(congestion_t *cc, const congestion_ack_t *ack);
+
+    /* loss detected by duplicate ACKs or SACK, just before recovery
+     * starts; set ssthresh (and, without uses_prr, cwnd)
+     */
+    void (*on_loss)(congestion_t *cc, uint32_t in_flight, uint64_t now);
+
+    /* the retransmission timer expired; set ssthresh and cwnd */
+    void (*on_rto)(congestion_t *cc, uint32_t in_flight, uint64_t now);
+} congestion_ops_t;
+
+
+/* access to a module's private state, which must fit in priv */
+#define CONGESTION_PRIV(cc, type) ((type *) (cc)->priv)
+
+#define CONGESTION_PRIV_CHECK(type) \
+    typedef char type##_fits_in_priv \
+        [(sizeof(type) <= CONGESTION_PRIV_WORDS * sizeof(uint64_t)) ? 1 : -1]
+
+/* sequence number comparison, for ack_seq and snd_nxt */
+#define CONGESTION_SEQ_GEQ(a, b) ((int32_t) ((a) - (b)) >= 0)
+
+
+/* built-in modules */
+extern const congestion_ops_t congestion_newreno;
+extern const congestion_ops_t congestion_cubic;
+extern const congestion_ops_t congestion_bbr;
+
+/* returns the module for a MYSO_CONGESTION value (see mysock.h) */
+const congestion_ops_t *congestion_lookup(int algorithm);
+
+/* start cc off with the given module, keeping the current window */
+void congestion_init(congestion_t *cc, const congestion_ops_t *ops);
+
+/* the classic halving of the window on loss (RFC 5681) */
+uint32_t congestion_reno_ssthresh(const congestion_t *cc, uint32_t in_flight);
+
+#endif  /* __CONGESTION_H__ */
@@ -0,0 +1,490 @@
+/* congestion_bbr.c--BBR-style model-based congestion control.
+ *
+ * rather than treating loss as the congestion signal, BBR keeps a model of
+ * the path: the bottleneck bandwidth (the windowed maximum of the delivery
+ * rate samples) and the round-trip propagation delay (the windowed minimum
+ * RTT).  it paces at about the bandwidth and keeps about one bandwidth-delay
+ * product in flight, which fills the pipe without building a queue.
+ *
+ * the connection goes through four modes:
+ *   - STARTUP doubles the sending rate every round until the bandwidth
+ *     estimate stops growing;
+ *   - DRAIN then empties the queue STARTUP built;
+ *   - PROBE_BW cycles the pacing gain, briefly sending faster to find more
+ *     bandwidth and then slower to drain what that added;
+ *   - PROBE_RTT, when the min-RTT estimate is getting old, cuts the window
+ *     to a few segments for a moment so the path's base RTT can be seen.
+ */
+
+#include <assert.h>
+#include "congestion.h"
+
+
+/* gains are in thousandths */
+#define BBR_UNIT            1000
+#define BBR_HIGH_GAIN       2885    /* 2/ln(2): doubles the rate per round */
+#define BBR_DRAIN_GAIN      347     /* 1/BBR_HIGH_GAIN */
+#define BBR_CWND_GAIN       2000
+
+#define BBR_GAIN_CYCLE_LEN  8
+static const int bbr_pacing_gain[BBR_GAIN_CYCLE_LEN] =
+{
+    1250, 750, 1000, 1000, 1000, 1000, 1000, 1000
+};
+
+#define BBR_BW_WINDOW_ROUNDS    10          /* max-bandwidth filter window */
+#define BBR_MIN_RTT_WINDOW      10000000    /* min-RTT filter window (us) */
+#define BBR_PROBE_RTT_TIME      200000      /* time spent in PROBE_RTT (us) */
+#define BBR_DEFAULT_RTT         1000        /* RTT assumed before a sample */
+#define BBR_MIN_CWND_SEGMENTS   4
+#define BBR_FULL_BW_GROWTH      1250        /* growth that keeps STARTUP on */
+#define BBR_FULL_BW_ROUNDS      3
+#define BBR_PACING_MARGIN       990         /* pace slightly below the model */
+
+typedef enum
+{
+    BBR_STARTUP,
+    BBR_DRAIN,
+    BBR_PROBE_BW,
+    BBR_PROBE_RTT
+} bbr_mode_t;
+
+/* a windowed max filter entry: bandwidth (bytes/s) seen in a round */
+typedef struct
+{
+    uint32_t round;
+    uint64_t bw;
+} bbr_bw_sample_t;
+
+typedef struct
+{
+    int mode;
+    int pacing_gain;
+    int cwnd_gain;
+
+    /* path model.  max_bw holds the best, second best and third best
+     * samples of the window, as in Kathleen Nichols' windowed min/max.
+     */
+    bbr_bw_sample_t max_bw[3];
+    uint32_t min_rtt;           /* us, or 0 before the first sample */
+    uint64_t min_rtt_stamp;
+
+    /* round-trip counting from delivery rate samples */
+    uint64_t delivered;
+    uint64_t next_round_delivered;
+    uint32_t round_count;
+    bool_t   round_start;
+
+    /* STARTUP: has the bandwidth stopped growing? */
+    uint64_t full_bw;
+    int      full_bw_count;
+    bool_t   full_bw_reached;
+
+    /* PROBE_BW */
+    int      cycle_index;
+    uint64_t cycle_stamp;
+
+    /* PROBE_RTT */
+    uint64_t probe_rtt_done_stamp;
+    bool_t   probe_rtt_round_done;
+
+    /* loss recovery: the window is restored to prior_cwnd afterwards */
+    uint32_t prior_cwnd;
+    bool_t   in_recovery;
+    bool_t   packet_conservation;
+} bbr_t;
+
+CONGESTION_PRIV_CHECK(bbr_t);
+
+static void bbr_update_bw(bbr_t *bbr, const congestion_ack_t *ack);
+static void bbr_update_min_rtt(bbr_t *bbr, const congestion_ack_t *ack);
+static void bbr_update_modes(congestion_t *cc, bbr_t *bbr,
+                             const congestion_ack_t *ack, uint32_t in_flight);
+static void bbr_update_probe_rtt(congestion_t *cc, bbr_t *bbr,
+                                 const congestion_ack_t *ack,
+                                 uint32_t in_flight, bool_t rtt_expired);
+static void bbr_set_pacing_rate(congestion_t *cc, bbr_t *bbr);
+static void bbr_set_cwnd(congestion_t *cc, bbr_t *bbr,
+                         const congestion_ack_t *ack, uint32_t in_flight);
+static void bbr_enter_probe_bw(bbr_t *bbr, uint64_t now);
+static void bbr_save_cwnd(congestion_t *cc, bbr_t *bbr);
+static uint32_t bbr_inflight(const congestion_t *cc, const bbr_t *bbr,
+                             int gain);
+
+
+static void bbr_init(congestion_t *cc)
+{
+    bbr_t *bbr = CONGESTION_PRIV(cc, bbr_t);
+
+    assert(cc);
+
+    bbr->mode = BBR_STARTUP;
+    bbr->pacing_gain = BBR_HIGH_GAIN;
+    bbr->cwnd_gain = BBR_HIGH_GAIN;
+
+    /* BBR keeps no slow start threshold */
+    cc->ssthresh = ~(uint32_t) 0;
+    bbr_set_pacing_rate(cc, bbr);
+}
+
+static void bbr_on_ack(congestion_t *cc, const congestion_ack_t *ack)
+{
+    bbr_t *bbr = CONGESTION_PRIV(cc, bbr_t);
+    uint32_t delivered = ack->acked + ack->sacked;
+    uint32_t in_flight;
+    bool_t rtt_expired;
+
+    assert(cc && ack);
+
+    in_flight = (ack->in_flight > delivered) ? ack->in_flight - delivered : 0;
+    bbr->delivered = ack->delivered;
+
+    /* a round trip ends when a segment sent after the last round began is
+     * acknowledged
+     */
+    bbr->round_start = FALSE;
+    if (ack->rate_interval && ack->prior_delivered >= bbr->next_round_delivered)
+    {
+        bbr->next_round_delivered = ack->delivered;
+        bbr->round_count++;
+        bbr->round_start = TRUE;
+        bbr->packet_conservation = FALSE;
+    }
+
+    bbr_update_bw(bbr, ack);
+
+    rtt_expired = bbr->min_rtt &&
+                  ack->now - bbr->min_rtt_stamp > BBR_MIN_RTT_WINDOW;
+    bbr_update_min_rtt(bbr, ack);
+
+    bbr_update_modes(cc, bbr, ack, in_flight);
+    bbr_update_probe_rtt(cc, bbr, ack, in_flight, rtt_expired);
+
+    bbr_set_pacing_rate(cc, bbr);
+    bbr_set_cwnd(cc, bbr, ack, in_flight);
+}
+
+/* loss does not change the model; the window is held to what is in flight
+ * (packet conservation, see bbr_set_cwnd()) for the first round of recovery
+ * and restored once recovery is over
+ */
+static void bbr_on_loss(congestion_t *cc, uint32_t in_flight, uint64_t now)
+{
+    assert(cc);
+    bbr_save_cwnd(cc, CONGESTION_PRIV(cc, bbr_t));
+}
+
+static void bbr_on_rto(congestion_t *cc, uint32_t in_flight, uint64_t now)
+{
+    bbr_t *bbr = CONGESTION_PRIV(cc, bbr_t);
+
+    assert(cc);
+
+    bbr_save_cwnd(cc, bbr);
+    cc->cwnd = cc->mss;
+}
+
+/* feed the delivery rate sample into the windowed max filter.  samples
+ * taken while the application was the bottleneck only count if they raise
+ * the estimate.
+ */
+static void bbr_update_bw(bbr_t *bbr, const congestion_ack_t *ack)
+{
+    bbr_bw_sample_t *s = bbr->max_bw, sample;
+    uint32_t age;
+
+    if (!ack->rate_interval)
+        return;
+
+    /* intervals shorter than the path's RTT come from ACK compression */
+    if (bbr->min_rtt && ack->rate_interval < bbr->min_rtt / 2)
+        return;
+
+    sample.round = bbr->round_count;
+    sample.bw = (uint64_t) ack->rate_delivered * 1000000 / ack->rate_interval;
+
+    if (ack->rate_app_limited && sample.bw < s[0].bw)
+        return;
+
+    if (sample.bw >= s[0].bw ||
+        sample.round - s[2].round > BBR_BW_WINDOW_ROUNDS)
+    {
+        s[0] = s[1] = s[2] = sample;
+        return;
+    }
+
+    if (sample.bw >= s[1].bw)
+        s[1] = s[2] = sample;
+    else if (sample.bw >= s[2].bw)
+        s[2] = sample;
+
+    /* age out the best sample, keeping the others spread over the window */
+    age = sample.round - s[0].round;
+    if (age > BBR_BW_WINDOW_ROUNDS)
+    {
+        s[0] = s[1];
+        s[1] = s[2];
+        s[2] = sample;
+        if (sample.round - s[0].round > BBR_BW_WINDOW_ROUNDS)
+        {
+            s[0] = s[1];
+            s[1] = s[2];
+        }
+    }
+    else if (s[1].round == s[0].round && age > BBR_BW_WINDOW_ROUNDS / 4)
+    {
+        s[1] = s[2] = sample;
+    }
+    else if (s[2].round == s[1].round && age > BBR_BW_WINDOW_ROUNDS / 2)
+    {
+        s[2] = sample;
+    }
+}
+
+static void bbr_update_min_rtt(bbr_t *bbr, const congestion_ack_t *ack)
+{
+    if (!ack->rtt)
+        return;
+
+    if (!bbr->min_rtt || ack->rtt <= bbr->min_rtt ||
+        ack->now - bbr->min_rtt_stamp > BBR_MIN_RTT_WINDOW)
+    {
+        bbr->min_rtt = ack->rtt;
+        bbr->min_rtt_stamp = ack->now;
+    }
+}
+
+static void bbr_update_modes(congestion_t *cc, bbr_t *bbr,
+                             const congestion_ack_t *ack, uint32_t in_flight)
+{
+    /* STARTUP ends once three rounds in a row fail to raise the bandwidth
+     * estimate by a quarter
+     */
+    if (!bbr->full_bw_reached && bbr->round_start && !ack->rate_app_limited)
+    {
+        if (bbr->max_bw[0].bw * BBR_UNIT >= bbr->full_bw * BBR_FULL_BW_GROWTH)
+        {
+            bbr->full_bw = bbr->max_bw[0].bw;
+            bbr->full_bw_count = 0;
+        }
+        else if (++bbr->full_bw_count >= BBR_FULL_BW_ROUNDS)
+        {
+            bbr->full_bw_reached = TRUE;
+        }
+    }
+
+    if (bbr->mode == BBR_STARTUP && bbr->full_bw_reached)
+    {
+        bbr->mode = BBR_DRAIN;
+        bbr->pacing_gain = BBR_DRAIN_GAIN;
+        bbr->cwnd_gain = BBR_HIGH_GAIN;
+    }
+
+    if (bbr->mode == BBR_DRAIN && in_flight <= bbr_inflight(cc, bbr, BBR_UNIT))
+        bbr_enter_probe_bw(bbr, ack->now);
+
+    /* PROBE_BW: move through the gain cycle, one min-RTT per phase.  the
+     * probing phase lasts until the extra data is actually in flight; the
+     * draining phase ends early once the queue is gone.
+     */
+    if (bbr->mode == BBR_PROBE_BW)
+    {
+        bool_t full_length =
+            ack->now - bbr->cycle_stamp > (bbr->min_rtt ? bbr->min_rtt
+                                                        : BBR_DEFAULT_RTT);
+        bool_t advance;
+
+        if (bbr->pacing_gain == BBR_UNIT)
+            advance = full_length;
+        else if (bbr->pacing_gain > BBR_UNIT)
+            advance = full_length &&
+                      ack->in_flight >= bbr_inflight(cc, bbr, bbr->pacing_gain);
+        else
+            advance = full_length ||
+                      in_flight <= bbr_inflight(cc, bbr, BBR_UNIT);
+
+        if (advance)
+        {
+            bbr->cycle_index = (bbr->cycle_index + 1) % BBR_GAIN_CYCLE_LEN;
+            bbr->cycle_stamp = ack->now;
+            bbr->pacing_gain = bbr_pacing_gain[bbr->cycle_index];
+        }
+    }
+}
+
+/* if the min-RTT estimate has not been refreshed for BBR_MIN_RTT_WINDOW,
+ * drain the pipe to a few segments for BBR_PROBE_RTT_TIME (and at least a
+ * round trip) so that an RTT sample without queueing can be taken
+ */
+static void bbr_update_probe_rtt(congestion_t *cc, bbr_t *bbr,
+                                 const congestion_ack_t *ack,
+                                 uint32_t in_flight, bool_t rtt_expired)
+{
+    if (bbr->mode != BBR_PROBE_RTT && rtt_expired)
+    {
+        bbr_save_cwnd(cc, bbr);
+        bbr->mode = BBR_PROBE_RTT;
+        bbr->pacing_gain = BBR_UNIT;
+        bbr->cwnd_gain = BBR_UNIT;
+        bbr->probe_rtt_done_stamp = 0;
+    }
+
+    if (bbr->mode != BBR_PROBE_RTT)
+        return;
+
+    if (!bbr->probe_rtt_done_stamp)
+    {
+        if (in_flight <= BBR_MIN_CWND_SEGMENTS * cc->mss)
+        {
+            bbr->probe_rtt_done_stamp = ack->now + BBR_PROBE_RTT_TIME;
+            bbr->probe_rtt_round_done = FALSE;
+            bbr->next_round_delivered = bbr->delivered;
+        }
+        return;
+    }
+
+    if (bbr->round_start)
+        bbr->probe_rtt_round_done = TRUE;
+
+    if (bbr->probe_rtt_round_done && ack->now >= bbr->probe_rtt_done_stamp)
+    {
+        bbr->min_rtt_stamp = ack->now;
+        if (cc->cwnd < bbr->prior_cwnd)
+            cc->cwnd = bbr->prior_cwnd;
+
+        if (bbr->full_bw_reached)
+        {
+            bbr_enter_probe_bw(bbr, ack->now);
+        }
+        else
+        {
+            bbr->mode = BBR_STARTUP;
+            bbr->pacing_gain = BBR_HIGH_GAIN;
+            bbr->cwnd_gain = BBR_HIGH_GAIN;
+        }
+    }
+}
+
+/* pace at pacing_gain times the bandwidth estimate.  until the pipe is
+ * known to be full the rate is never lowered, so an early low estimate
+ * can't hold STARTUP back.
+ */
+static void bbr_set_pacing_rate(congestion_t *cc, bbr_t *bbr)
+{
+    uint64_t rate;
+
+    if (bbr->max_bw[0].bw)
+    {
+        rate = bbr->max_bw[0].bw;
+    }
+    else
+    {
+        /* no samples yet: the initial window over the RTT */
+        rate = (uint64_t) cc->cwnd * 1000000 /
+               (bbr->min_rtt ? bbr->min_rtt : BBR_DEFAULT_RTT);
+    }
+
+    rate = rate * bbr->pacing_gain / BBR_UNIT * BBR_PACING_MARGIN / BBR_UNIT;
+    if (rate > 0xffffffff)
+        rate = 0xffffffff;
+    if (rate == 0)
+        rate = 1;
+
+    if (bbr->full_bw_reached || rate > cc->pacing_rate)
+        cc->pacing_rate = (uint32_t) rate;
+}
+
+/* the window is cwnd_gain bandwidth-delay products, reached by growing with
+ * each ACK.  during recovery it is first held to what is in flight plus
+ * what was just delivered, and restored afterwards.
+ */
+static void bbr_set_cwnd(congestion_t *cc, bbr_t *bbr,
+                         const congestion_ack_t *ack, uint32_t in_flight)
+{
+    uint32_t delivered = ack->acked + ack->sacked;
+    uint32_t target = bbr_inflight(cc, bbr, bbr->cwnd_gain);
+    uint32_t min_cwnd = BBR_MIN_CWND_SEGMENTS * cc->mss;
+
+    if (ack->in_recovery && !bbr->in_recovery)
+    {
+        bbr->in_recovery = TRUE;
+        bbr->packet_conservation = TRUE;
+        bbr->next_round_delivered = ack->delivered;
+        cc->cwnd = in_flight + delivered;
+    }
+    else if (!ack->in_recovery && bbr->in_recovery)
+    {
+        bbr->in_recovery = FALSE;
+        bbr->packet_conservation = FALSE;
+        if (cc->cwnd < bbr->prior_cwnd)
+            cc->cwnd = bbr->prior_cwnd;
+    }
+
+    if (bbr->packet_conservation)
+    {
+        if (cc->cwnd < in_flight + delivered)
+            cc->cwnd = in_flight + delivered;
+    }
+    else if (bbr->full_bw_reached)
+    {
+        cc->cwnd = (cc->cwnd + delivered < target) ? cc->cwnd + delivered
+                                                    : target;
+    }
+    else if (cc->cwnd < target || ack->delivered < 10 * cc->mss)
+    {
+        cc->cwnd += delivered;
+    }
+
+    if (cc->cwnd < min_cwnd)
+        cc->cwnd = min_cwnd;
+    if (bbr->mode == BBR_PROBE_RTT && cc->cwnd > min_cwnd)
+        cc->cwnd = min_cwnd;
+}
+
+static void bbr_enter_probe_bw(bbr_t *bbr, uint64_t now)
+{
+    bbr->mode = BBR_PROBE_BW;
+    bbr->cwnd_gain = BBR_CWND_GAIN;
+
+    /* start at a random phase other than the draining one */
+    bbr->cycle_index = (int) (now % (BBR_GAIN_CYCLE_LEN - 1));
+    if (bbr->cycle_index >= 1)
+        bbr->cycle_index++;
+    bbr->cycle_stamp = now;
+    bbr->pacing_gain = bbr_pacing_gain[bbr->cycle_index];
+}
+
+/* remember the window to return to after recovery or PROBE_RTT */
+static void bbr_save_cwnd(congestion_t *cc, bbr_t *bbr)
+{
+    if (!bbr->in_recovery && bbr->mode != BBR_PROBE_RTT)
+        bbr->prior_cwnd = cc->cwnd;
+    else if (cc->cwnd > bbr->prior_cwnd)
+        bbr->prior_cwnd = cc->cwnd;
+}
+
+/* gain times the estimated bandwidth-delay product, plus a little slack for
+ * ACKs that arrive in bursts
+ */
+static uint32_t bbr_inflight(const congestion_t *cc, const bbr_t *bbr,
+                             int gain)
+{
+    uint64_t bdp;
+
+    if (!bbr->max_bw[0].bw || !bbr->min_rtt)
+        return cc->cwnd;
+
+    bdp = bbr->max_bw[0].bw * bbr->min_rtt / 1000000;
+    bdp = bdp * gain / BBR_UNIT + 3 * cc->mss;
+    return (bdp > 0xffffffff) ? 0xffffffff : (uint32_t) bdp;
+}
+
+const congestion_ops_t congestion_bbr =
+{
+    "bbr",
+    FALSE,
+    bbr_init,
+    bbr_on_ack,
+    bbr_on_loss,
+    bbr_on_rto
+};
@@ -0,0 +1,220 @@
+/* congestion_cubic.c--CUBIC congestion control (RFC 9438), with delay-based
+ * HyStart (RFC 9406) to leave slow start before it overshoots.
+ *
+ * after a reduction the window follows a cubic function of the time since
+ * then, returning quickly to the window at which loss last occurred (w_max),
+ * lingering there, and then probing beyond it.  on short-RTT paths, where
+ * Reno grows faster than the cubic, the window tracks a Reno estimate
+ * instead.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include "congestion.h"
+
+
+#define CUBIC_C     0.4     /* scaling constant (segments/s^3) */
+#define CUBIC_BETA  0.7     /* multiplicative decrease factor */
+
+/* HyStart parameters (RFC 9406) */
+#define HYSTART_LOW_WINDOW      16      /* segments before HyStart is used */
+#define HYSTART_N_RTT_SAMPLE    8       /* RTT samples per round */
+#define HYSTART_MIN_RTT_THRESH  4000    /* us */
+#define HYSTART_MAX_RTT_THRESH  16000   /* us */
+#define HYSTART_NO_RTT          0xffffffff
+
+typedef struct
+{
+    /* congestion avoidance.  windows are in segments. */
+    double   w_max;         /* window before the last reduction */
+    double   k;             /* seconds for the cubic to get back to w_max */
+    double   w_est;         /* Reno-friendly estimate */
+    uint64_t epoch_start;   /* start of the current epoch (us), 0 if none */
+    uint32_t min_rtt;       /* smallest RTT seen (us) */
+
+    /* HyStart round tracking */
+    bool_t   hystart_done;
+    bool_t   round_started;
+    uint32_t round_end;     /* the round ends once this is acknowledged */
+    uint32_t last_round_min_rtt;
+    uint32_t curr_round_min_rtt;
+    int      rtt_samples;
+} cubic_t;
+
+CONGESTION_PRIV_CHECK(cubic_t);
+
+static void hystart_update(congestion_t *cc, cubic_t *cubic,
+                           const congestion_ack_t *ack);
+static void cubic_reduce(congestion_t *cc, cubic_t *cubic);
+
+
+static void cubic_init(congestion_t *cc)
+{
+    cubic_t *cubic = CONGESTION_PRIV(cc, cubic_t);
+
+    assert(cc);
+
+    cubic->last_round_min_rtt = HYSTART_NO_RTT;
+    cubic->curr_round_min_rtt = HYSTART_NO_RTT;
+}
+
+static void cubic_on_ack(congestion_t *cc, const congestion_ack_t *ack)
+{
+    cubic_t *cubic = CONGESTION_PRIV(cc, cubic_t);
+    double cwnd, t, target;
+
+    assert(cc && ack);
+
+    if (ack->rtt && (!cubic->min_rtt || ack->rtt < cubic->min_rtt))
+        cubic->min_rtt = ack->rtt;
+
+    /* the transport layer sets the window while recovering */
+    if (ack->in_recovery || !ack->acked)
+        return;
+
+    if (cc->cwnd < cc->ssthresh)
+    {
+        hystart_update(cc, cubic, ack);
+
+        if (cc->cwnd < cc->ssthresh)
+        {
+            /* slow start, counting bytes as NewReno does */
+            cc->cwnd += (ack->acked < 2 * cc->mss) ? ack->acked : 2 * cc->mss;
+            return;
+        }
+    }
+
+    cwnd = (double) cc->cwnd / cc->mss;
+
+    if (!cubic->epoch_start)
+    {
+        /* first ACK in congestion avoidance since the last reduction */
+        cubic->epoch_start = ack->now;
+        if (cwnd < cubic->w_max)
+        {
+            cubic->k = cbrt((cubic->w_max - cwnd) / CUBIC_C);
+        }
+        else
+        {
+            cubic->k = 0;
+            cubic->w_max = cwnd;
+        }
+        cubic->w_est = cwnd;
+    }
+
+    /* aim for where the cubic will be one RTT from now, but never grow by
+     * more than half the window per RTT
+     */
+    t = (double) (ack->now - cubic->epoch_start + cubic->min_rtt) / 1e6;
+    target = CUBIC_C * (t - cubic->k) * (t - cubic->k) * (t - cubic->k) +
+             cubic->w_max;
+    if (target > 1.5 * cwnd)
+        target = 1.5 * cwnd;
+
+    /* Reno-friendly region: grow at least as fast as Reno would */
+    cubic->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) *
+                    ((double) ack->acked / cc->mss) / cwnd;
+    if (cubic->w_est > target)
+        target = cubic->w_est;
+
+    if (target > cwnd)
+    {
+        double increase = (target - cwnd) / cwnd * ack->acked;
+        cc->cwnd += (increase >= 1) ? (uint32_t) increase : 1;
+    }
+}
+
+static void cubic_on_loss(congestion_t *cc, uint32_t in_flight, uint64_t now)
+{
+    assert(cc);
+    cubic_reduce(cc, CONGESTION_PRIV(cc, cubic_t));
+}
+
+static void cubic_on_rto(congestion_t *cc, uint32_t in_flight, uint64_t now)
+{
+    cubic_t *cubic = CONGESTION_PRIV(cc, cubic_t);
+
+    assert(cc);
+
+    cubic_reduce(cc, cubic);
+    cc->cwnd = cc->mss;
+
+    /* slow start begins again, so HyStart gets another go */
+    cubic->hystart_done = FALSE;
+    cubic->round_started = FALSE;
+    cubic->last_round_min_rtt = HYSTART_NO_RTT;
+    cubic->curr_round_min_rtt = HYSTART_NO_RTT;
+}
+
+/* multiplicative decrease; remember where the loss happened, or a little
+ * below if the window was already shrinking (fast convergence)
+ */
+static void cubic_reduce(congestion_t *cc, cubic_t *cubic)
+{
+    double cwnd = (double) cc->cwnd / cc->mss;
+    uint32_t ssthresh = (uint32_t) (cc->cwnd * CUBIC_BETA);
+
+    if (cwnd < cubic->w_max)
+        cubic->w_max = cwnd * (1 + CUBIC_BETA) / 2;
+    else
+        cubic->w_max = cwnd;
+
+    cubic->epoch_start = 0;
+    cc->ssthresh = (ssthresh > 2 * cc->mss) ? ssthresh : 2 * cc->mss;
+}
+
+/* leave slow start once the RTT of a round rises noticeably above that of
+ * the previous round, i.e. a queue has started to build
+ */
+static void hystart_update(congestion_t *cc, cubic_t *cubic,
+                           const congestion_ack_t *ack)
+{
+    uint32_t eta;
+
+    if (cubic->hystart_done)
+        return;
+
+    if (!cubic->round_started ||
+        CONGESTION_SEQ_GEQ(ack->ack_seq, cubic->round_end))
+    {
+        cubic->round_started = TRUE;
+        cubic->round_end = ack->snd_nxt;
+        cubic->last_round_min_rtt = cubic->curr_round_min_rtt;
+        cubic->curr_round_min_rtt = HYSTART_NO_RTT;
+        cubic->rtt_samples = 0;
+    }
+
+    if (!ack->rtt)
+        return;
+
+    if (ack->rtt < cubic->curr_round_min_rtt)
+        cubic->curr_round_min_rtt = ack->rtt;
+    cubic->rtt_samples++;
+
+    if (cc->cwnd < HYSTART_LOW_WINDOW * cc->mss ||
+        cubic->rtt_samples < HYSTART_N_RTT_SAMPLE ||
+        cubic->last_round_min_rtt == HYSTART_NO_RTT)
+        return;
+
+    eta = cubic->last_round_min_rtt / 8;
+    if (eta < HYSTART_MIN_RTT_THRESH)
+        eta = HYSTART_MIN_RTT_THRESH;
+    if (eta > HYSTART_MAX_RTT_THRESH)
+        eta = HYSTART_MAX_RTT_THRESH;
+
+    if (cubic->curr_round_min_rtt >= cubic->last_round_min_rtt + eta)
+    {
+        cubic->hystart_done = TRUE;
+        cc->ssthresh = cc->cwnd;
+    }
+}
+
+const congestion_ops_t congestion_cubic =
+{
+    "cubic",
+    TRUE,
+    cubic_init,
+    cubic_on_ack,
+    cubic_on_loss,
+    cubic_on_rto
+};
@@ -0,0 +1,64 @@
+/* congestion_newreno.c--the standard TCP congestion control (RFC 5681),
+ * with the NewReno refinements (RFC 6582) left to the transport layer's
+ * recovery code.
+ */
+
+#include <assert.h>
+#include "congestion.h"
+
+
+static void newreno_init(congestion_t *cc)
+{
+    assert(cc);
+}
+
+/* slow start, then congestion avoidance.  growth follows the bytes
+ * acknowledged (RFC 3465, L = 2) so that a peer delaying its ACKs does not
+ * slow it down.
+ */
+static void newreno_on_ack(congestion_t *cc, const congestion_ack_t *ack)
+{
+    uint32_t increase;
+
+    assert(cc && ack);
+
+    /* the transport layer sets the window while recovering */
+    if (ack->in_recovery || !ack->acked)
+        return;
+
+    if (cc->cwnd < cc->ssthresh)
+    {
+        increase = (ack->acked < 2 * cc->mss) ? ack->acked : 2 * cc->mss;
+    }
+    else
+    {
+        increase = (uint32_t) ((uint64_t) cc->mss * ack->acked / cc->cwnd);
+        if (increase == 0)
+            increase = 1;
+    }
+
+    cc->cwnd += increase;
+}
+
+static void newreno_on_loss(congestion_t *cc, uint32_t in_flight, uint64_t now)
+{
+    assert(cc);
+    cc->ssthresh = congestion_reno_ssthresh(cc, in_flight);
+}
+
+static void newreno_on_rto(congestion_t *cc, uint32_t in_flight, uint64_t now)
+{
+    assert(cc);
+    cc->ssthresh = congestion_reno_ssthresh(cc, in_flight);
+    cc->cwnd = cc->mss;
+}
+
+const congestion_ops_t congestion_newreno =
+{
+    "newreno",
+    TRUE,
+    newreno_init,
+    newreno_on_ack,
+    newreno_on_loss,
+    newreno_on_rto
+};
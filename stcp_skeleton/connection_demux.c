@@ -52,6 +52,18 @@ typedef struct
     pthread_mutex_t      connection_lock;
 } listen_queue_t;
 
+/* what remains of a connection in TIME_WAIT: enough to recognise an old
+ * duplicate of its SYN.  tombstones are freed when their timer goes off.
+ */
+typedef struct time_wait
+{
+    struct sockaddr   peer_addr;
+    uint16_t          local_port;   /* network byte order */
+    uint32_t          peer_seq;     /* next sequence number expected */
+    wheel_timer_t     timer;
+    struct time_wait *next;
+} time_wait_t;
+
 #define INVALIDATE_CONNECT_REQUEST(r) \
     { \
         memset(r, 0, sizeof(connect_request_t)); \
@@ -65,7 +77,15 @@ HASH_TABLE_DECLARE(listen_table, mysocket_t, listen_queue_t *,
                    MAX_NUM_CONNECTIONS);
 static pthread_rwlock_t listen_lock; /* XXX: see notes in network_io_vns.c */
 
+/* connections in TIME_WAIT, on any local port */
+static time_wait_t    *time_wait_list;
+static pthread_mutex_t time_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static listen_queue_t *_get_connection_queue(mysock_context_t *ctx);
+static bool_t _in_time_wait(uint16_t local_port,
+                            const struct sockaddr *peer_addr,
+                            const void *packet);
+static void _time_wait_expired(void *arg);
 
 
 /* called by myaccept() to grab the first completed connection off the
@@ -171,6 +191,14 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
         goto done;  /* the socket was closed or not listening */
     }
 
+    if (_in_time_wait(_network_get_port(&ctx->network_state),
+                      peer_addr, packet))
+    {
+        DEBUG_CONNECTION_MSG("dropping SYN packet",
+                             "(old duplicate of connection in TIME_WAIT)");
+        goto done;
+    }
+
     /* see if this is a retransmission of an existing request */
     for (k = 0; k < q->max_len; ++k)
     {
@@ -220,6 +248,7 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
 
         new_ctx = _mysock_get_context(queue_entry->sd);
         new_ctx->listen_sd = ctx->my_sd;
+        _mysock_inherit_options(new_ctx, ctx);
 
         new_ctx->network_state.peer_addr       = *peer_addr;
         new_ctx->network_state.peer_addr_len   = peer_addr_len;
@@ -238,11 +267,13 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
                                       &ctx->network_state,
                                       user_data, packet, packet_len);
 
-        _mysock_transport_init(queue_entry->sd, FALSE);
+        /* pass the SYN packet on to the main STCP code.  this must come
+         * before the new connection's threads start: the network receive
+         * thread is the only other thread that may add to its ring.
+         */
+        _mysock_enqueue_packet(new_ctx, packet, packet_len);
 
-        /* pass the SYN packet on to the main STCP code */
-        _mysock_enqueue_buffer(new_ctx, &new_ctx->network_recv_queue,
-                               packet, packet_len);
+        _mysock_transport_init(queue_entry->sd, FALSE);
     }
     else
     {
@@ -404,3 +435,79 @@ static listen_queue_t *_get_connection_queue(mysock_context_t *ctx)
     return HASH_LOOKUP_PTR(listen_table, ctx->my_sd);
 }
 
+/* keep a tombstone for the connection until time expires (us), on the
+ * timer wheel shared with the transport layer's timers
+ */
+void _mysock_enter_time_wait(mysock_context_t *ctx, uint32_t peer_seq,
+                             uint64_t expires)
+{
+    time_wait_t *tw;
+
+    assert(ctx && ctx->network_state.peer_addr_valid);
+
+    tw = (time_wait_t *) calloc(1, sizeof(time_wait_t));
+    assert(tw);
+
+    tw->peer_addr = ctx->network_state.peer_addr;
+    tw->local_port = _network_get_port(&ctx->network_state);
+    tw->peer_seq = peer_seq;
+    tw->timer.callback = _time_wait_expired;
+    tw->timer.arg = tw;
+
+    PTHREAD_CALL(pthread_mutex_lock(&time_wait_lock));
+    tw->next = time_wait_list;
+    time_wait_list = tw;
+    PTHREAD_CALL(pthread_mutex_unlock(&time_wait_lock));
+
+    /* not under time_wait_lock: the callback takes it with the timer lock
+     * held.  nothing else frees the tombstone, so it can't vanish first.
+     */
+    _mysock_timer_arm(&tw->timer, expires);
+}
+
+/* TRUE if the SYN in packet is from the peer of a connection on the given
+ * local port that is in TIME_WAIT, and its sequence number doesn't show it
+ * to be a new incarnation of that connection (RFC 1122, section 4.2.2.13)
+ */
+static bool_t _in_time_wait(uint16_t local_port,
+                            const struct sockaddr *peer_addr,
+                            const void *packet)
+{
+    uint32_t seq = ntohl(((const struct tcphdr *) packet)->th_seq);
+    const struct sockaddr_in *peer = (const struct sockaddr_in *) peer_addr;
+    bool_t old_duplicate = FALSE;
+    time_wait_t *tw;
+
+    PTHREAD_CALL(pthread_mutex_lock(&time_wait_lock));
+    for (tw = time_wait_list; tw && !old_duplicate; tw = tw->next)
+    {
+        const struct sockaddr_in *tw_peer =
+            (const struct sockaddr_in *) &tw->peer_addr;
+
+        if (tw->local_port == local_port &&
+            tw_peer->sin_addr.s_addr == peer->sin_addr.s_addr &&
+            tw_peer->sin_port == peer->sin_port)
+            old_duplicate = (int32_t) (seq - tw->peer_seq) <= 0;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&time_wait_lock));
+
+    return old_duplicate;
+}
+
+/* TIME_WAIT is over (on the timer thread) */
+static void _time_wait_expired(void *arg)
+{
+    time_wait_t *tw = (time_wait_t *) arg, **p;
+
+    assert(tw);
+
+    PTHREAD_CALL(pthread_mutex_lock(&time_wait_lock));
+    for (p = &time_wait_list; *p != tw; p = &(*p)->next)
+        assert(*p);
+    *p = tw->next;
+    PTHREAD_CALL(pthread_mutex_unlock(&time_wait_lock));
+
+    DEBUG_LOG(("TIME_WAIT over for local port %hu\n",
+               ntohs(tw->local_port)));
+    free(tw);
+}
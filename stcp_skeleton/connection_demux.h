@@ -22,5 +22,8 @@ void _mysock_close_passive_socket(struct mysock_context *ctx);
 
 void _mysock_passive_connection_complete(struct mysock_context *new_ctx);
 
+void _mysock_enter_time_wait(struct mysock_context *ctx, uint32_t peer_seq,
+                             uint64_t expires);
+
 #endif  /* __CONNECTION_DEMUX_H__ */
 
@@ -28,12 +28,30 @@ static void *transport_thread_func(void *arg);
 static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
                                        mysocket_t        my_sd);
 static mysock_context_t *_mysock_allocate_context(void);
-static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq);
+static size_t _mysock_app_ring_size(int requested);
+static void _mysock_timer_expired(void *arg);
 
 
 /* mysocket descriptor table, one entry per STCP connection */
 static mysock_context_t *global_ctx[MAX_NUM_CONNECTIONS];
 
+/* initial mysetsockopt() values for a new mysocket, indexed by option */
+static const int default_options[MYSO_NUM_OPTIONS] =
+{
+    40,     /* MYSO_ACK_DELAY */
+    0,      /* MYSO_NODELAY */
+    0,      /* MYSO_CORK */
+    1,      /* MYSO_AUTOCORK */
+    MYSO_CC_CUBIC,  /* MYSO_CONGESTION */
+    256 * 1024,     /* MYSO_SNDBUF */
+    256 * 1024,     /* MYSO_RCVBUF */
+    30000,          /* MYSO_CONNECT_TIMEOUT */
+    0,              /* MYSO_KEEPALIVE */
+    7200000,        /* MYSO_KEEPIDLE */
+    75000,          /* MYSO_KEEPINTVL */
+    9               /* MYSO_KEEPCNT */
+};
+
 
 /* create a new mysocket, and find space in our mysocket descriptor table */
 mysocket_t _mysock_new_mysocket()
@@ -81,6 +99,21 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active)
     assert(!connection_context->listening);
     connection_context->is_active = is_active;
 
+    /* the byte rings between the app and STCP are sized once, here, like
+     * STCP's own buffers.  the one carrying data up to the app has room for
+     * a packet beyond the largest window STCP can offer, as scaled windows
+     * are rounded up.
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&connection_context->data_ready_lock));
+    byte_ring_init(&connection_context->app_send_ring,
+                   _mysock_app_ring_size(
+                       connection_context->options[MYSO_RCVBUF]) +
+                   MAX_PACKET_LEN);
+    byte_ring_init(&connection_context->app_recv_ring,
+                   _mysock_app_ring_size(
+                       connection_context->options[MYSO_SNDBUF]));
+    PTHREAD_CALL(pthread_mutex_unlock(&connection_context->data_ready_lock));
+
     /* start a new network thread; this handles incoming data, passing it
      * up to the transport layer.  (the network input is threaded so we can
      * keep track of timeouts/when data arrives, in a portable manner
@@ -117,142 +150,139 @@ int _mysock_wait_for_connection(mysock_context_t *ctx)
 }
 
 
-/* add an incoming buffer (packet) to a queue for this connection; it will be
- * dequeued by stcp_network_recv() or myread() when the transport layer or
- * application is ready to use it, depending on the queue to which
- * the buffer (or packet) is added.
+/* hand a packet from the peer to the transport layer.  only one thread at a
+ * time may do this--the connection's network receive thread, or before it
+ * starts, the thread setting up the connection--as the ring has a single
+ * producer.  a NULL packet says the network layer has failed, and nothing
+ * more will arrive; stcp_network_recv() returns 0 once the packets before
+ * it have been received.
  *
- * in the interest of simplicity (and since we aren't writing a high
- * performance TCP stack), this just copies the specified buffer for its own
- * use, so the calling code can do whatever it wants with the packet
- * afterwards.  the copied buffer is freed later by dequeue_buffer().
+ * the packet is copied, so the caller may reuse its buffer.  if the ring
+ * is full, the transport layer has fallen well behind, and the packet is
+ * dropped, as a router with a full queue would; the peer will resend it.
  */
-void _mysock_enqueue_buffer(mysock_context_t *ctx,
-                            packet_queue_t   *pq,
+void _mysock_enqueue_packet(mysock_context_t *ctx,
                             const void       *packet,
                             size_t            packet_len)
 {
-    packet_queue_node_t *node;
-
-    assert(ctx && pq && (packet || !packet_len));
+    packet_ring_t *ring;
 
-    node = (packet_queue_node_t *) calloc(1, sizeof(packet_queue_node_t));
-    assert(node);
+    assert(ctx && (packet || !packet_len));
+    ring = &ctx->network_recv_ring;
 
-    node->data = (char *) malloc(packet_len * sizeof(char));
-    assert(node->data);
-
-    if (packet_len > 0)
-        memcpy(node->data, packet, packet_len);
-    node->data_len = packet_len;
-
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    if (!pq->head)
+    if (!packet)
     {
-        assert(!pq->tail);
-        pq->head = pq->tail = node;
+        packet_ring_close(ring);
     }
     else
     {
-        assert(pq->tail);
-        assert(!pq->tail->next);
-        assert(!node->next);
-        pq->tail->next = node;
-        pq->tail = node;
+        packet_queue_node_t *node = (packet_queue_node_t *)
+            buffer_pool_alloc(&ctx->buffer_pool,
+                              sizeof(packet_queue_node_t) + packet_len);
+
+        node->data     = (char *) (node + 1);
+        node->next     = NULL;
+        node->data_len = packet_len;
+        memcpy(node->data, packet, packet_len);
+
+        if (!packet_ring_push(ring, node))
+        {
+            DEBUG_LOG(("network receive ring full, dropping packet\n"));
+            buffer_pool_free(node);
+            return;
+        }
     }
-    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+
+    _mysock_wake_waiter(ctx, &ring->consumer_waiting);
 }
 
-/* remove one packet from the head of the waiting packet queue, copying the
- * packet's payload into the specified buffer.  returns the number of bytes
- * copied.  if remove_partial is true, and there is insufficient room in the
- * destination buffer for the packet at the head of the queue, it is only
- * partially dequeued, and the remaining contents remain at the queue's head
- * for a subsequent call to dequeue_buffer().
+/* the number of packets the transport thread can receive without blocking,
+ * counting the end of input, once the ring is closed, as one more
  */
-size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
-                              packet_queue_t   *pq,
-                              void             *dst,
-                              size_t            max_len,
-                              bool_t            remove_partial)
+size_t _mysock_packets_waiting(mysock_context_t *ctx)
 {
-    packet_queue_node_t *node;
-    size_t               packet_len;
+    bool_t closed;
 
-    assert(ctx && pq && dst);
+    assert(ctx);
+    closed = packet_ring_closed(&ctx->network_recv_ring);
+    return packet_ring_count(&ctx->network_recv_ring) + (closed ? 1 : 0);
+}
 
-    /* block until queue is non-empty */
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    while (!pq->head)
-    {
-        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
-                                       &ctx->data_ready_lock));
-    }
+/* the rings between threads take no lock to move data, so a thread that
+ * has to wait on data_ready_cond for the other end of one says so in a
+ * flag belonging to that end of the ring, and the other thread takes
+ * data_ready_lock to wake it only if the flag is set.  the waiter sets the
+ * flag with data_ready_lock held, then must check the ring again before
+ * waiting.  a fence on each side, between setting the flag and checking
+ * the ring, and between moving data and checking the flag, means either
+ * the waiter sees the data or the other thread sees the flag.
+ */
+void _mysock_set_waiter(bool_t *waiting_flag, bool_t waiting)
+{
+    assert(waiting_flag);
 
-    node = pq->head;
-    assert(node && node->data);
+    __atomic_store_n(waiting_flag, waiting, __ATOMIC_RELAXED);
+    if (waiting)
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
 
-    if (node->data_len > max_len && remove_partial)
-    {
-        /* remove only a portion of the packet at the head of the queue,
-         * leaving the rest around for the next call to dequeue_buffer().
-         */
-        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+/* called after moving data through a ring: wake the thread at its other
+ * end, if the flag says it has gone, or is going, to sleep
+ */
+void _mysock_wake_waiter(mysock_context_t *ctx, const bool_t *waiting_flag)
+{
+    assert(ctx && waiting_flag);
 
-        memcpy(dst, node->data, max_len);
-        memmove(node->data, node->data + max_len, node->data_len - max_len);
-        node->data_len -= max_len;
-        packet_len = max_len;
-    }
-    else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting_flag, __ATOMIC_RELAXED))
     {
-        /* dequeue the entire packet at the head of the queue */
-        if (!(pq->head = pq->head->next))
-        {
-            assert(pq->tail == node);
-            pq->tail = NULL;
-        }
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
         PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-
-        memcpy(dst, node->data, MIN(max_len, node->data_len));
-        packet_len = node->data_len;
-
-        free(node->data);
-
-        memset(node, 0, sizeof(*node));
-        free(node);
     }
-
-    return packet_len;
 }
 
-/* free any last buffers in the specified queue, discarding the contents.
- * this is called only when the mysocket context is being deallocated, so
- * there are no concerns about thread safety here.  returns TRUE if
- * non-zero-length buffers were deallocated, FALSE otherwise.
+/* take the packet at the head of the network receive ring, blocking until
+ * there is one, and copy at most max_len bytes of it into dst.  returns the
+ * length of the packet, or 0 once the ring has been closed and drained.
  */
-static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq)
+size_t _mysock_dequeue_packet(mysock_context_t *ctx,
+                              void             *dst,
+                              size_t            max_len)
 {
+    packet_ring_t       *ring;
     packet_queue_node_t *node;
-    bool_t result = FALSE;
+    size_t               packet_len;
 
-    assert(ctx && pq);
-    result = (pq->head != NULL);
-    for (node = pq->head; node; )
-    {
-        packet_queue_node_t *next = node->next;
+    assert(ctx && dst);
+    ring = &ctx->network_recv_ring;
 
-        if (node->data_len > 0)
-            result = TRUE;
+    while (!(node = (packet_queue_node_t *) packet_ring_pop(ring)))
+    {
+        if (packet_ring_closed(ring))
+        {
+            /* nothing can have been pushed after the close */
+            if (!(node = (packet_queue_node_t *) packet_ring_pop(ring)))
+                return 0;
+            break;
+        }
 
-        free(node->data);
-        free(node);
-        node = next;
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        _mysock_set_waiter(&ring->consumer_waiting, TRUE);
+        while (!_mysock_packets_waiting(ctx))
+        {
+            PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                           &ctx->data_ready_lock));
+        }
+        _mysock_set_waiter(&ring->consumer_waiting, FALSE);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
     }
 
-    pq->head = pq->tail = NULL;
-    return result;
+    memcpy(dst, node->data, MIN(max_len, node->data_len));
+    packet_len = node->data_len;
+
+    buffer_pool_free(node);
+    return packet_len;
 }
 
 /* allocate a new connection context.  this keeps track of the working state
@@ -284,6 +314,14 @@ static mysock_context_t *_mysock_allocate_context(void)
 
     ctx->blocking = TRUE;   /* we unblock once we're connected */
 
+    buffer_pool_init(&ctx->buffer_pool);
+    packet_ring_init(&ctx->network_recv_ring);
+
+    /* the transport layer's timer wakes up stcp_wait_for_event() */
+    ctx->timer.callback = _mysock_timer_expired;
+    ctx->timer.arg = ctx;
+
+    memcpy(ctx->options, default_options, sizeof(ctx->options));
 
     /* initialise underlying network state.  this includes creating the actual
      * socket used for communication to the peer--this is analogous to the
@@ -304,10 +342,14 @@ static mysock_context_t *_mysock_allocate_context(void)
  */
 void _mysock_free_context(mysock_context_t *ctx)
 {
+    packet_queue_node_t *node;
     int sd;
 
     assert(ctx);
 
+    /* the timer callback takes data_ready_lock, so it must be stopped first */
+    _mysock_timer_cancel(&ctx->timer);
+
     PTHREAD_CALL(pthread_cond_destroy(&ctx->blocking_cond));
     PTHREAD_CALL(pthread_mutex_destroy(&ctx->blocking_lock));
 
@@ -316,14 +358,17 @@ void _mysock_free_context(mysock_context_t *ctx)
 
     /* free any last buffers that might be lying around (e.g. retransmitted
      * packets from the peer).  normally, the application from/to queues
-     * should be empty by this point; the network receive queue may
+     * should be empty by this point; the network receive ring may
      * legitimately have retransmitted packets, so silently discard these.
      */
-    (void) _mysock_free_queue(ctx, &ctx->network_recv_queue);
-    (void) _mysock_free_queue(ctx, &ctx->app_recv_queue);
-    (void) _mysock_free_queue(ctx, &ctx->app_send_queue);
+    while ((node = (packet_queue_node_t *)
+                packet_ring_pop(&ctx->network_recv_ring)) != NULL)
+        buffer_pool_free(node);
+    byte_ring_destroy(&ctx->app_recv_ring);
+    byte_ring_destroy(&ctx->app_send_ring);
 
     _network_close(&ctx->network_state);
+    buffer_pool_destroy(&ctx->buffer_pool);
 
     /* clear mysocket descriptor table entry */
     sd = ctx->my_sd;
@@ -334,13 +379,38 @@ void _mysock_free_context(mysock_context_t *ctx)
     free(ctx);
 }
 
+/* the transport layer's timer went off (on the timer thread) */
+static void _mysock_timer_expired(void *arg)
+{
+    mysock_context_t *ctx = (mysock_context_t *) arg;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->timer_expired = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+}
+
+/* give a newly accepted connection the options of its listening mysocket.
+ * this is done before the connection's transport thread is started.
+ */
+void _mysock_inherit_options(mysock_context_t *ctx,
+                             mysock_context_t *listen_ctx)
+{
+    assert(ctx && listen_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&listen_ctx->data_ready_lock));
+    memcpy(ctx->options, listen_ctx->options, sizeof(ctx->options));
+    PTHREAD_CALL(pthread_mutex_unlock(&listen_ctx->data_ready_lock));
+}
+
 /* transport layer thread; transport_init() should not return until the
  * transport layer finishes (i.e. the connection is over).
  */
 static void *transport_thread_func(void *arg_ptr)
 {
     mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
-    char eof_packet;
 
     assert(ctx);
     ASSERT_VALID_MYSOCKET_DESCRIPTOR(ctx, ctx->my_sd);
@@ -383,12 +453,44 @@ static void *transport_thread_func(void *arg_ptr)
     }
 
     /* force final myread() to return 0 bytes (this should have been done
-     * by the transport layer already in response to the peer's FIN).
+     * by the transport layer already in response to the peer's FIN), and
+     * stop mywrite() waiting for room that will never come.
      */
-    _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, &eof_packet, 0);
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->transport_exited = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    _mysock_app_eof(ctx);
     return NULL;
 }
 
+/* the end of the data passed up to the app; myread() returns 0 once it has
+ * taken everything before it.  called only from the transport thread.
+ */
+void _mysock_app_eof(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    byte_ring_close(&ctx->app_send_ring);
+    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
+/* the size of a byte ring between the app and STCP for a MYSO_SNDBUF or
+ * MYSO_RCVBUF value.  this is at least the size STCP makes its own buffer
+ * for the same value, which is a power of two no smaller than four
+ * segments.
+ */
+static size_t _mysock_app_ring_size(int requested)
+{
+    size_t size = 4096;
+    size_t wanted = MAX((size_t) requested, 4 * (size_t) MAX_PACKET_LEN);
+
+    while (size < wanted && size < MYSO_MAX_BUFFER_SIZE)
+        size <<= 1;
+    return size;
+}
+
 
 /* perform some basic sanity checks on the given mysocket descriptor.  if
  * comp_ctx is non-NULL, it is checked against the context found for the given
@@ -35,6 +35,50 @@ typedef int mysocket_t;     /* mysocket descriptor */
 #endif
 
 
+/* per-mysocket options, for mysetsockopt() and mygetsockopt().  all option
+ * values are ints.  a connection returned by myaccept() starts with the
+ * options of the listening mysocket it came from.
+ */
+typedef enum
+{
+    MYSO_ACK_DELAY = 0,     /* max. time (ms) to delay an ACK; 0 = no delay */
+    MYSO_NODELAY,           /* non-zero disables Nagle's algorithm */
+    MYSO_CORK,              /* non-zero holds back partial segments */
+    MYSO_AUTOCORK,          /* non-zero coalesces queued writes */
+    MYSO_CONGESTION,        /* congestion control algorithm, see below */
+    MYSO_SNDBUF,            /* send buffer size (bytes) */
+    MYSO_RCVBUF,            /* receive buffer size (bytes); bounds the window */
+    MYSO_CONNECT_TIMEOUT,   /* max. time (ms) for the handshake; 0 = none */
+    MYSO_KEEPALIVE,         /* non-zero probes idle connections, see below */
+    MYSO_KEEPIDLE,          /* idle time (ms) before the first probe */
+    MYSO_KEEPINTVL,         /* time (ms) between unanswered probes */
+    MYSO_KEEPCNT,           /* unanswered probes before giving up */
+    MYSO_NUM_OPTIONS
+} mysockopt_t;
+
+/* largest MYSO_SNDBUF or MYSO_RCVBUF.  buffer sizes are fixed when the
+ * connection is set up, so they must be chosen before myconnect() or
+ * mylisten().
+ */
+#define MYSO_MAX_BUFFER_SIZE (16 * 1024 * 1024)
+
+/* with MYSO_KEEPALIVE set, a connection on which nothing has been heard
+ * from the peer for MYSO_KEEPIDLE, and which has no data of its own
+ * outstanding, sends the peer a probe it has to answer.  if MYSO_KEEPCNT
+ * probes, MYSO_KEEPINTVL apart, all go unanswered, the connection is
+ * abandoned, and myread() and mywrite() fail with ETIMEDOUT.
+ */
+
+/* MYSO_CONGESTION values */
+typedef enum
+{
+    MYSO_CC_NEWRENO = 0,
+    MYSO_CC_CUBIC,
+    MYSO_CC_BBR,
+    MYSO_NUM_CC
+} mysock_cc_t;
+
+
 extern mysocket_t mysocket();
 extern int mybind(mysocket_t sd, struct sockaddr *addr, int addrlen);
 extern int mylisten(mysocket_t sd, int backlog);
@@ -47,6 +91,8 @@ extern int mygetsockname(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 extern int mygetpeername(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
+extern int mysetsockopt(mysocket_t sd, int option, int value);
+extern int mygetsockopt(mysocket_t sd, int option, int *value);
 
 /* return IP address of interface on which packets to/from peer_addr are
  * delivered.  peer_addr is in network byte order.
@@ -100,26 +100,35 @@ mysocket_t myaccept(mysocket_t sd, struct sockaddr *addr, int *addrlen)
 #endif  /*DEBUG*/
 
     /* the new socket is created on an incoming SYN.  block here until we
-     * establish a connection, or STCP indicates an error condition.
+     * establish a connection.  one whose handshake STCP gave up on (e.g. a
+     * half-open connection whose peer went away) is reaped here rather than
+     * passed up to the application.
      */
-    _mysock_dequeue_connection(accept_ctx, &ctx);
-    assert(ctx);
-
-    if (!ctx->stcp_errno)
+    for (;;)
     {
-        /* fill in addr, addrlen with address of peer */
-        assert(ctx->network_state.peer_addr_len > 0);
+        _mysock_dequeue_connection(accept_ctx, &ctx);
+        assert(ctx);
+        assert(ctx->listen_sd == sd);
 
-        if (addr && addrlen)
-        {
-            *addr    = ctx->network_state.peer_addr;
-            *addrlen = ctx->network_state.peer_addr_len;
-        }
+        if (!ctx->stcp_errno)
+            break;
+
+        DEBUG_LOG(("myaccept(%d) reaping failed connection %d (errno %d)\n",
+                   sd, ctx->my_sd, ctx->stcp_errno));
+        myclose(ctx->my_sd);
+    }
+
+    /* fill in addr, addrlen with address of peer */
+    assert(ctx->network_state.peer_addr_len > 0);
+
+    if (addr && addrlen)
+    {
+        *addr    = ctx->network_state.peer_addr;
+        *addrlen = ctx->network_state.peer_addr_len;
     }
 
-    assert(ctx->listen_sd == sd);
     DEBUG_LOG(("***myaccept(%d) returning new sd %d***\n", sd, ctx->my_sd));
-    return (errno = ctx->stcp_errno) ? -1 : ctx->my_sd;
+    return ctx->my_sd;
 }
 
 /* in this implementation, mylisten() is assumed to follow mybind() */
@@ -154,9 +163,10 @@ int mylisten(mysocket_t sd, int backlog)
 }
 
 /* close the given mysocket.  note that the semantics of myclose() differ
- * slightly from a regular close(); STCP doesn't implement TIME_WAIT, so
- * myclose() simply discards all knowledge of the connection once the
- * connection is terminated.
+ * slightly from a regular close(); it blocks until the connection is
+ * terminated, and then frees the mysocket at once.  if this end closed
+ * first, TIME_WAIT is kept by a small tombstone (see stcp_enter_time_wait())
+ * rather than the mysocket itself.
  */
 int myclose(mysocket_t sd)
 {
@@ -195,20 +205,66 @@ int myclose(mysocket_t sd)
     return 0;
 }
 
+/* queue all of buf for STCP to send, blocking while the send ring is full.
+ * if the connection fails first, this returns what was queued, or -1 if
+ * that was nothing.
+ */
 int mywrite(mysocket_t sd, const void *buf, size_t buf_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
+    size_t written = 0;
+    int error = 0;
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(ctx->app_recv_ring.data != NULL, ENOTCONN);
 
     assert(!ctx->close_requested);
-    _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue, buf, buf_len);
 
-    /* XXX: all bytes are queued, irrespective of current sender window */
-    return buf_len;
+    /* STCP sets conn_errno under the lock when it gives up */
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    error = ctx->conn_errno;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    MYSOCK_CHECK(!error, error);
+
+    while (written < buf_len && !error)
+    {
+        size_t len = byte_ring_write(&ctx->app_recv_ring,
+                                     (const char *) buf + written,
+                                     buf_len - written);
+
+        written += len;
+
+        if (len > 0)
+            _mysock_wake_waiter(ctx, &ctx->app_recv_ring.consumer_waiting);
+
+        if (written < buf_len)
+        {
+            /* the ring is full; wait for STCP to take some */
+            PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+            _mysock_set_waiter(&ctx->app_recv_ring.producer_waiting, TRUE);
+            while (byte_ring_space(&ctx->app_recv_ring) == 0 &&
+                   !ctx->conn_errno && !ctx->transport_exited)
+            {
+                PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                               &ctx->data_ready_lock));
+            }
+            _mysock_set_waiter(&ctx->app_recv_ring.producer_waiting, FALSE);
+            if (ctx->conn_errno)
+                error = ctx->conn_errno;
+            else if (ctx->transport_exited)
+                error = EPIPE;
+            PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        }
+    }
+
+    MYSOCK_CHECK(written > 0 || !buf_len, error);
+    return written;
 }
 
+/* read whatever has arrived, up to buf_len bytes, blocking only until
+ * something has
+ */
 int myread(mysocket_t sd, void *buf, size_t buf_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
@@ -216,17 +272,46 @@ int myread(mysocket_t sd, void *buf, size_t buf_len)
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(ctx->app_send_ring.data != NULL, ENOTCONN);
 
     assert(!ctx->close_requested);
 
     if (ctx->eof)
+    {
+        MYSOCK_CHECK(!ctx->conn_errno, ctx->conn_errno);
         return 0;
+    }
+
+    if (byte_ring_count(&ctx->app_send_ring) == 0)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        _mysock_set_waiter(&ctx->app_send_ring.consumer_waiting, TRUE);
+        while (byte_ring_count(&ctx->app_send_ring) == 0 &&
+               !byte_ring_closed(&ctx->app_send_ring))
+        {
+            PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                           &ctx->data_ready_lock));
+        }
+        _mysock_set_waiter(&ctx->app_send_ring.consumer_waiting, FALSE);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
 
-    if ((len = _mysock_dequeue_buffer(ctx, &ctx->app_send_queue,
-                                      buf, buf_len, TRUE)) == 0)
+    /* a closed ring gets nothing more, so if it's empty now, that's EOF */
+    if ((len = byte_ring_read(&ctx->app_send_ring, buf, buf_len)) == 0)
     {
         /* make sure repeated calls to myread() return 0 on EOF */
         ctx->eof = TRUE;
+
+        /* ...or the error that ended the connection, if STCP gave up */
+        MYSOCK_CHECK(!ctx->conn_errno, ctx->conn_errno);
+    }
+    else
+    {
+        /* the space may let STCP open its receive window again, or let
+         * stcp_app_send() finish; either way STCP is the ring's producer
+         */
+        __atomic_store_n(&ctx->data_consumed, TRUE, __ATOMIC_RELAXED);
+        _mysock_wake_waiter(ctx, &ctx->app_send_ring.producer_waiting);
     }
 
     return len;
@@ -279,6 +364,48 @@ int mygetpeername(mysocket_t sd, struct sockaddr *name, socklen_t *namelen)
     return 0;
 }
 
+/* set a per-mysocket option (see mysockopt_t in mysock.h).  this may be
+ * done at any time; the transport layer of an established connection is
+ * woken up to act on the new value (e.g. to send data held back by
+ * MYSO_CORK).
+ */
+int mysetsockopt(mysocket_t sd, int option, int value)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(option >= 0 && option < MYSO_NUM_OPTIONS, ENOPROTOOPT);
+    MYSOCK_CHECK(value >= 0, EINVAL);
+    MYSOCK_CHECK(option != MYSO_CONGESTION || value < MYSO_NUM_CC, EINVAL);
+    MYSOCK_CHECK((option != MYSO_SNDBUF && option != MYSO_RCVBUF) ||
+                 value <= MYSO_MAX_BUFFER_SIZE, EINVAL);
+    MYSOCK_CHECK((option != MYSO_KEEPIDLE && option != MYSO_KEEPINTVL &&
+                  option != MYSO_KEEPCNT) || value > 0, EINVAL);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->options[option] = value;
+    ctx->options_changed = TRUE;
+    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    return 0;
+}
+
+int mygetsockopt(mysocket_t sd, int option, int *value)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(value);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(value != NULL, EFAULT);
+    MYSOCK_CHECK(option >= 0 && option < MYSO_NUM_OPTIONS, ENOPROTOOPT);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    *value = ctx->options[option];
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    return 0;
+}
+
 /* returns IP address of interface on which packets to/from network address
  * peer_addr (network byte order) are delivered.
  */
@@ -14,6 +14,10 @@
 #include <pthread.h>
 #include "mysock.h"
 #include "network_io.h"
+#include "timer_wheel.h"
+#include "buffer_pool.h"
+#include "packet_ring.h"
+#include "byte_ring.h"
 
 #ifdef __GNUC__
     #define INLINE __inline__
@@ -39,6 +43,9 @@ static INLINE void _pthread_call(int pthread_retval)
 #ifndef MIN
     #define MIN(a,b)    ((a) < (b) ? (a) : (b))
 #endif
+#ifndef MAX
+    #define MAX(a,b)    ((a) > (b) ? (a) : (b))
+#endif
 
 #ifdef DEBUG
     /* usage:  DEBUG_LOG((fmt string, args, ...)) */
@@ -56,12 +63,6 @@ typedef struct packet_queue_node
     struct packet_queue_node *next;
 } packet_queue_node_t;
 
-typedef struct
-{
-    packet_queue_node_t *head;
-    packet_queue_node_t *tail;
-} packet_queue_t;
-
 /* mysocket context (and the arguments provided to the transport layer
  * thread).  most of this is mysock/network layer working state, with STCP
  * working state maintained separately by the student.  there is one instance
@@ -97,21 +98,38 @@ typedef struct mysock_context
     /* STCP thread */
     pthread_t       transport_thread;
     bool_t          transport_thread_started;
+    bool_t          transport_exited;   /* transport_init() returned? */
 
     /* is data ready from either network or the app? */
     pthread_cond_t  data_ready_cond;
     pthread_mutex_t data_ready_lock;
     bool_t          close_requested;    /* myclose() called by app? */
+    bool_t          options_changed;    /* mysetsockopt() called by app? */
+    bool_t          data_consumed;      /* myread() took data? (atomic) */
     bool_t          eof;                /* true once peer finishes writing */
+    int             conn_errno;         /* why STCP abandoned the connection */
+    int             options[MYSO_NUM_OPTIONS];  /* see mysetsockopt() */
+
+    /* the transport layer's timer (see stcp_set_timer()) */
+    wheel_timer_t   timer;
+    bool_t          timer_expired;
 
     /* data sent to peer is sent immediately, so no queue is needed for that
-     * case.  we keep a queue for the other three cases:  data coming from
-     * peer, data sent to the app for consumption with myread(), and data
-     * coming from the app via mywrite().
+     * case.  we keep a ring for each of the other three cases:  data coming
+     * from peer, data sent to the app for consumption with myread(), and
+     * data coming from the app via mywrite().  each passes between just two
+     * threads, so none needs a lock.  data from the peer keeps its packet
+     * boundaries; data to and from the app is a byte stream, and its rings
+     * are allocated by _mysock_transport_init().
      */
-    packet_queue_t  network_recv_queue; /* data coming from peer */
-    packet_queue_t  app_send_queue; /* data to be passed up to app */
-    packet_queue_t  app_recv_queue; /* data coming from app */
+    packet_ring_t   network_recv_ring;  /* data coming from peer */
+    byte_ring_t     app_send_ring;  /* data to be passed up to app */
+    byte_ring_t     app_recv_ring;  /* data coming from app */
+
+    /* where queued buffers come from.  each is a packet_queue_node_t with
+     * its data following it.
+     */
+    buffer_pool_t   buffer_pool;
 } mysock_context_t;
 
 
@@ -126,20 +144,34 @@ int _mysock_wait_for_connection(mysock_context_t *ctx);
 
 void _mysock_free_context(mysock_context_t *ctx);
 
-void _mysock_enqueue_buffer(mysock_context_t *ctx,
-                            packet_queue_t   *pq,
+void _mysock_inherit_options(mysock_context_t *ctx,
+                             mysock_context_t *listen_ctx);
+
+void _mysock_enqueue_packet(mysock_context_t *ctx,
                             const void       *packet,
                             size_t            packet_len);
 
-size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
-                              packet_queue_t   *pq,
+size_t _mysock_packets_waiting(mysock_context_t *ctx);
+
+void _mysock_set_waiter(bool_t *waiting_flag, bool_t waiting);
+
+void _mysock_wake_waiter(mysock_context_t *ctx, const bool_t *waiting_flag);
+
+void _mysock_app_eof(mysock_context_t *ctx);
+
+size_t _mysock_dequeue_packet(mysock_context_t *ctx,
                               void             *dst,
-                              size_t            max_len,
-                              bool_t            remove_partial);
+                              size_t            max_len);
 
 int _mysock_bind_ephemeral(mysock_context_t *ctx);
 
 pthread_t _mysock_create_thread(void *(*start)(void *args), void *args,                                         bool_t create_detached);
 
+/* mysock_timer.c */
+uint64_t _mysock_current_time(void);
+
+void _mysock_timer_arm(wheel_timer_t *timer, uint64_t expires);
+void _mysock_timer_cancel(wheel_timer_t *timer);
+
 #endif  /* __MYSOCK_INTERNAL_H__ */
 
@@ -0,0 +1,108 @@
+/* mysock_timer.c--timers shared by all mysockets.
+ *
+ * a single thread drives one hierarchical timer wheel (see timer_wheel.h)
+ * on CLOCK_MONOTONIC for every connection, sleeping until the wheel next
+ * has work to do.  callbacks run on that thread with the timer lock held,
+ * so they must be brief and must not arm or cancel timers themselves.
+ */
+
+#include <time.h>
+#include "mysock_impl.h"
+
+
+static void timer_service_init(void);
+static void *timer_thread_func(void *arg);
+
+static timer_wheel_t   timer_wheel;
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  timer_cond;  /* waits on CLOCK_MONOTONIC */
+static pthread_once_t  timer_once = PTHREAD_ONCE_INIT;
+
+/* when the timer thread is next due to wake up (us), or 0 if it is waiting
+ * for a timer to be armed
+ */
+static uint64_t timer_wakeup;
+
+
+/* current time in microseconds, on the clock the timers run on */
+uint64_t _mysock_current_time(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+    {
+        assert(0);
+        abort();
+    }
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* arm the timer to call its callback at time expires (us), moving it if it
+ * is already armed
+ */
+void _mysock_timer_arm(wheel_timer_t *timer, uint64_t expires)
+{
+    assert(timer && timer->callback);
+
+    PTHREAD_CALL(pthread_once(&timer_once, timer_service_init));
+
+    PTHREAD_CALL(pthread_mutex_lock(&timer_lock));
+    timer_wheel_arm(&timer_wheel, timer, expires);
+
+    /* the timer thread only needs waking if it would sleep through this */
+    if (!timer_wakeup || expires < timer_wakeup)
+        PTHREAD_CALL(pthread_cond_signal(&timer_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&timer_lock));
+}
+
+/* disarm the timer.  once this returns, its callback is not running and
+ * won't be called.
+ */
+void _mysock_timer_cancel(wheel_timer_t *timer)
+{
+    assert(timer);
+
+    PTHREAD_CALL(pthread_mutex_lock(&timer_lock));
+    timer_wheel_cancel(&timer_wheel, timer);
+    PTHREAD_CALL(pthread_mutex_unlock(&timer_lock));
+}
+
+/* set up the wheel and start its thread, the first time a timer is armed */
+static void timer_service_init(void)
+{
+    pthread_condattr_t attr;
+
+    PTHREAD_CALL(pthread_condattr_init(&attr));
+    PTHREAD_CALL(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+    PTHREAD_CALL(pthread_cond_init(&timer_cond, &attr));
+    PTHREAD_CALL(pthread_condattr_destroy(&attr));
+
+    timer_wheel_init(&timer_wheel, _mysock_current_time());
+    (void) _mysock_create_thread(timer_thread_func, NULL, TRUE);
+}
+
+static void *timer_thread_func(void *arg)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&timer_lock));
+    for (;;)
+    {
+        struct timespec deadline;
+        int rc;
+
+        timer_wheel_advance(&timer_wheel, _mysock_current_time());
+
+        if (!(timer_wakeup = timer_wheel_next_event(&timer_wheel)))
+        {
+            PTHREAD_CALL(pthread_cond_wait(&timer_cond, &timer_lock));
+            continue;
+        }
+
+        deadline.tv_sec = timer_wakeup / 1000000;
+        deadline.tv_nsec = (timer_wakeup % 1000000) * 1000;
+        rc = pthread_cond_timedwait(&timer_cond, &timer_lock, &deadline);
+        assert(rc == 0 || rc == ETIMEDOUT || rc == EINTR);
+    }
+
+    /*NOTREACHED*/
+    return NULL;
+}
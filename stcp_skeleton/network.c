@@ -33,13 +33,9 @@ int _network_send(mysocket_t sd, const void *buf, size_t len)
 /* helper function for stcp_network_recv() */
 int _network_recv(mysocket_t sd, void *dst, size_t max_len)
 {
-    int len;
     mysock_context_t *ctx = _mysock_get_context(sd);
 
     assert(ctx && dst);
-    len = _mysock_dequeue_buffer(ctx, &ctx->network_recv_queue,
-                                 dst, max_len, FALSE);
-
-    return len;
+    return _mysock_dequeue_packet(ctx, dst, max_len);
 }
 
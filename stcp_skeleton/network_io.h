@@ -13,6 +13,11 @@
 
 #define MAX_IP_PAYLOAD_LEN 1500
 
+/* largest packet the network layer handles at all; each backend reports
+ * what it can actually carry with _network_max_packet_len()
+ */
+#define MAX_PACKET_LEN 65535
+
 
 struct mysock_context;
 
@@ -33,7 +38,7 @@ typedef struct
     /* packet reordering/duplication simulation */
     unsigned int random_seed;
     bool_t       copied;
-    char         copy_buffer[MAX_IP_PAYLOAD_LEN];
+    char         copy_buffer[MAX_PACKET_LEN];
     size_t       copy_buf_len;
 } network_context_t;
 
@@ -61,6 +66,11 @@ uint32_t _network_get_local_addr(network_context_t *ctx);
  */
 uint32_t _network_get_interface_ip(uint32_t peer_addr);
 
+/* returns the largest STCP packet (header included) that can be sent to
+ * the peer in one piece
+ */
+size_t _network_max_packet_len(network_context_t *ctx);
+
 /* send an STCP packet to our peer */
 ssize_t _network_send_packet(network_context_t *ctx,
                              const void *src, size_t len);
@@ -207,7 +207,7 @@ int _network_bind_socket(network_context_t *ctx,
  */
 static void *network_recv_thread_func(void *arg_ptr)
 {
-    char packet_buf[MAX_IP_PAYLOAD_LEN];
+    char packet_buf[MAX_PACKET_LEN];
     mysock_context_t *ctx;
     network_context_socket_t *net_ctx;
 
@@ -266,7 +266,7 @@ static void *network_recv_thread_func(void *arg_ptr)
         {
             DEBUG_LOG(("_network_recv_packet interrupted, errno=%d\n", errno));
             //signal an error to the transport layer
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
+            _mysock_enqueue_packet(ctx, NULL, 0);
             break;
         }
 
@@ -284,8 +284,7 @@ static void *network_recv_thread_func(void *arg_ptr)
         else
         {
             /* enqueue the packet directly for this context */
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue,
-                                   packet_buf, bytes_read);
+            _mysock_enqueue_packet(ctx, packet_buf, bytes_read);
         }
     }
 
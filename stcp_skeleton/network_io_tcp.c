@@ -5,8 +5,12 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <alloca.h>
 #include "mysock_impl.h"
 #include "network_io.h"
@@ -18,7 +22,9 @@
 typedef ssize_t (*io_func_t)(socket_t sd, void *buf, size_t count);
 
 static int _tcp_io(socket_t, void *, size_t, io_func_t);
+static int _tcp_writev(socket_t, struct iovec *, int);
 static int _tcp_connect(network_context_t *ctx);
+static void _tcp_set_nodelay(socket_t tcp_sd);
 
 
 /* a few words about using TCP to emulate the underlying datagram
@@ -137,6 +143,7 @@ ssize_t _network_send_packet(network_context_t *ctx,
 {
     network_context_socket_tcp_t *tcp_io_ctx;
     uint16_t packet_len;    /* network byte order */
+    struct iovec iov[2];
 
     assert(ctx && src);
     assert(ctx->peer_addr_len > 0);
@@ -150,15 +157,31 @@ ssize_t _network_send_packet(network_context_t *ctx,
     if (_tcp_connect(ctx) < 0)
         return -1;
 
+    /* the length and the packet go out in a single writev().  written
+     * separately, the packet would sit behind the length in the host TCP's
+     * Nagle queue until the peer's delayed ACK of the length arrived.
+     */
     packet_len = htons(len);
-    if (_tcp_io(GET_SOCKET(ctx), &packet_len, sizeof(packet_len),
-                (io_func_t) write) < 0 ||
-        _tcp_io(GET_SOCKET(ctx), (void *) src, len, (io_func_t) write) < 0)
+    iov[0].iov_base = &packet_len;
+    iov[0].iov_len  = sizeof(packet_len);
+    iov[1].iov_base = (void *) src;
+    iov[1].iov_len  = len;
+
+    if (_tcp_writev(GET_SOCKET(ctx), iov, 2) < 0)
         return -1;
 
     return len;
 }
 
+/* each packet is framed by a 16-bit length, and the host TCP takes care of
+ * segmenting it, so packets are limited only by the length field
+ */
+size_t _network_max_packet_len(network_context_t *ctx)
+{
+    assert(ctx);
+    return MAX_PACKET_LEN;
+}
+
 /* read a packet from the peer */
 ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
 {
@@ -201,6 +224,7 @@ ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
          * socket updated to be 'new_socket'
          */
         assert(tcp_io_ctx->new_socket == -1);
+        _tcp_set_nodelay(tmp_sd);
         tcp_io_ctx->new_socket = tmp_sd;
         io_socket = tmp_sd;
     }
@@ -264,6 +288,40 @@ static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
     return count;
 }
 
+/* as _tcp_io() with write(), but gathering from iovcnt buffers; iov is
+ * advanced past whatever each partial write takes
+ */
+static int _tcp_writev(socket_t tcp_sd, struct iovec *iov, int iovcnt)
+{
+    size_t count = 0;
+    int k;
+
+    assert(iov && iovcnt > 0);
+    for (k = 0; k < iovcnt; ++k)
+        count += iov[k].iov_len;
+
+    while (iovcnt > 0)
+    {
+        ssize_t rc;
+
+        if ((rc = writev(tcp_sd, iov, iovcnt)) <= 0)
+        {
+            DEBUG_LOG(("_tcp_writev rc: %d\n", (int) rc));
+            return rc;
+        }
+
+        for (; iovcnt > 0 && (size_t) rc >= iov->iov_len; ++iov, --iovcnt)
+            rc -= iov->iov_len;
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return count;
+}
+
 static int _tcp_connect(network_context_t *ctx)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
@@ -291,6 +349,7 @@ static int _tcp_connect(network_context_t *ctx)
             return -1;
         }
 
+        _tcp_set_nodelay(GET_SOCKET(ctx));
         tcp_io_ctx->connected = TRUE;
     }
     PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
@@ -298,3 +357,15 @@ static int _tcp_connect(network_context_t *ctx)
     return 0;
 }
 
+/* each write() on the TCP connection is a whole STCP packet, and STCP does
+ * its own batching and ACK timing; the host TCP's Nagle algorithm would only
+ * add delay, e.g. holding back a pure STCP ACK behind an earlier one.
+ */
+static void _tcp_set_nodelay(socket_t tcp_sd)
+{
+    int on = 1;
+
+    if (setsockopt(tcp_sd, IPPROTO_TCP, TCP_NODELAY,
+                   (const char *) &on, sizeof(on)) < 0)
+        perror("setsockopt TCP_NODELAY (network_io_tcp)");
+}
@@ -0,0 +1,64 @@
+/* packet_ring.c--bounded single-producer, single-consumer packet ring */
+
+#include <assert.h>
+#include <string.h>
+#include "packet_ring.h"
+
+
+#define SLOT(index) ((index) & (PACKET_RING_SIZE - 1))
+
+
+void packet_ring_init(packet_ring_t *ring)
+{
+    assert(ring);
+    memset(ring, 0, sizeof(*ring));
+}
+
+bool_t packet_ring_push(packet_ring_t *ring, void *packet)
+{
+    uint32_t tail = ring->tail;
+
+    assert(packet && !ring->closed);
+
+    /* the acquire pairs with the consumer's release of head, so the slot
+     * isn't overwritten before the consumer has read it
+     */
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+        PACKET_RING_SIZE)
+        return FALSE;
+
+    ring->slots[SLOT(tail)] = packet;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+void packet_ring_close(packet_ring_t *ring)
+{
+    /* ordered after every push, so a consumer seeing it sees them too */
+    __atomic_store_n(&ring->closed, TRUE, __ATOMIC_RELEASE);
+}
+
+void *packet_ring_pop(packet_ring_t *ring)
+{
+    uint32_t head = ring->head;
+    void *packet;
+
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    packet = ring->slots[SLOT(head)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return packet;
+}
+
+size_t packet_ring_count(const packet_ring_t *ring)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+}
+
+bool_t packet_ring_closed(const packet_ring_t *ring)
+{
+    return __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,63 @@
+/* packet_ring.h--bounded single-producer, single-consumer packet ring.
+ *
+ * one thread adds packets at the tail and one other thread takes them from
+ * the head, neither taking a lock: each end's index is written only by the
+ * thread that owns it, and published to the other with release/acquire
+ * ordering.  the two indices live on separate cache lines, so the threads
+ * don't bounce a line between them on every packet.
+ *
+ * the ring only carries pointers; it neither allocates nor frees what they
+ * point to, and it does not block.  a consumer that wants to sleep on an
+ * empty ring arranges that itself.
+ */
+
+#ifndef __PACKET_RING_H__
+#define __PACKET_RING_H__
+
+#include <stddef.h>
+#include "mysock.h"   /* uint32_t, bool_t */
+
+
+#define PACKET_RING_SIZE 1024       /* packets; a power of two */
+#define CACHE_LINE_SIZE  64
+
+typedef struct
+{
+    /* written by the producer */
+    uint32_t tail;                  /* next slot to fill */
+    bool_t   closed;                /* nothing more will be pushed */
+    char     producer_pad[CACHE_LINE_SIZE];
+
+    /* written by the consumer */
+    uint32_t head;                  /* next slot to take */
+    bool_t   consumer_waiting;      /* see _mysock_set_waiter() */
+    char     consumer_pad[CACHE_LINE_SIZE];
+
+    void    *slots[PACKET_RING_SIZE];
+} packet_ring_t;
+
+
+void packet_ring_init(packet_ring_t *ring);
+
+/* producer: add packet at the tail.  returns FALSE, leaving the ring as it
+ * was, if it is full.
+ */
+bool_t packet_ring_push(packet_ring_t *ring, void *packet);
+
+/* producer: say that no more packets are coming */
+void packet_ring_close(packet_ring_t *ring);
+
+/* consumer: take the packet at the head, or NULL if the ring is empty */
+void *packet_ring_pop(packet_ring_t *ring);
+
+/* packets waiting.  exact only for the consumer; the producer's count may
+ * be stale by the time it returns.
+ */
+size_t packet_ring_count(const packet_ring_t *ring);
+
+/* TRUE once the producer has closed the ring.  a consumer seeing this and
+ * then finding the ring empty knows it will stay empty.
+ */
+bool_t packet_ring_closed(const packet_ring_t *ring);
+
+#endif  /* __PACKET_RING_H__ */
@@ -48,6 +48,27 @@ void stcp_unblock_application(mysocket_t sd)
 }
 
 
+/* called by the transport layer thread when an established connection fails.
+ * the error is reported by myread() in place of the end-of-file indication,
+ * and by any subsequent mywrite().
+ */
+void stcp_abort_connection(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    int stcp_errno = errno;
+
+    assert(ctx);
+    assert(stcp_errno != 0);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->conn_errno = stcp_errno;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    DEBUG_LOG(("stcp_abort_connection(%d):  errno %d\n", sd, stcp_errno));
+    _mysock_app_eof(ctx);
+}
+
+
 /* called by the transport layer to wait for new data, either from the network
  * or from the application, or for the application to request that the
  * mysocket be closed, depending on the value of flags.  abstime is the
@@ -67,16 +88,27 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
     mysock_context_t *ctx = _mysock_get_context(sd);
 
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+
+    /* packets, the app's data, and the room myread() makes all come
+     * without the lock; see _mysock_set_waiter()
+     */
+    if (flags & NETWORK_DATA)
+        _mysock_set_waiter(&ctx->network_recv_ring.consumer_waiting, TRUE);
+    if (flags & APP_DATA)
+        _mysock_set_waiter(&ctx->app_recv_ring.consumer_waiting, TRUE);
+    if (flags & APP_DATA_CONSUMED)
+        _mysock_set_waiter(&ctx->app_send_ring.producer_waiting, TRUE);
+
     for (;;)
     {
-        if ((flags & APP_DATA) && (ctx->app_recv_queue.head != NULL))
+        if ((flags & APP_DATA) && byte_ring_count(&ctx->app_recv_ring) > 0)
             rc |= APP_DATA;
 
-        if ((flags & NETWORK_DATA) && (ctx->network_recv_queue.head != NULL))
+        if ((flags & NETWORK_DATA) && _mysock_packets_waiting(ctx) > 0)
             rc |= NETWORK_DATA;
 
-        if (/*(flags & APP_CLOSE_REQUESTED) &&*/
-            ctx->close_requested && (ctx->app_recv_queue.head == NULL))
+        if ((flags & APP_CLOSE_REQUESTED) &&
+            ctx->close_requested && byte_ring_count(&ctx->app_recv_ring) == 0)
         {
             /* we should only wake up on this event once.  also, we don't
              * pass the close event down to STCP until we've already passed
@@ -86,9 +118,26 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
             rc |= APP_CLOSE_REQUESTED;
         }
 
+        if ((flags & APP_OPTIONS_CHANGED) && ctx->options_changed)
+        {
+            ctx->options_changed = FALSE;
+            rc |= APP_OPTIONS_CHANGED;
+        }
+
+        if ((flags & APP_DATA_CONSUMED) &&
+            __atomic_exchange_n(&ctx->data_consumed, FALSE, __ATOMIC_RELAXED))
+            rc |= APP_DATA_CONSUMED;
+
         if (rc)
             break;
 
+        /* the timer set with stcp_set_timer() went off */
+        if (ctx->timer_expired)
+        {
+            ctx->timer_expired = FALSE;
+            break;
+        }
+
         if (abstime)
         {
             /* wait with timeout */
@@ -121,11 +170,61 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
     }
 
 done:
+    if (flags & NETWORK_DATA)
+        _mysock_set_waiter(&ctx->network_recv_ring.consumer_waiting, FALSE);
+    if (flags & APP_DATA)
+        _mysock_set_waiter(&ctx->app_recv_ring.consumer_waiting, FALSE);
+    if (flags & APP_DATA_CONSUMED)
+        _mysock_set_waiter(&ctx->app_send_ring.producer_waiting, FALSE);
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
 
     return rc;
 }
 
+/* current time in microseconds, on the clock stcp_set_timer() uses */
+uint64_t stcp_current_time(void)
+{
+    return _mysock_current_time();
+}
+
+/* arrange for stcp_wait_for_event() to return at time expires, or cancel
+ * the connection's timer if expires is zero.  a time already past wakes
+ * the next wait at once, as a timeout in the past does.
+ */
+void stcp_set_timer(mysocket_t sd, uint64_t expires)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+
+    if (expires && expires > _mysock_current_time())
+    {
+        _mysock_timer_arm(&ctx->timer, expires);
+        return;
+    }
+
+    _mysock_timer_cancel(&ctx->timer);
+    if (expires)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        ctx->timer_expired = TRUE;
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
+}
+
+/* called by the transport layer as it leaves a connection in TIME_WAIT.
+ * the mysocket layer remembers the connection until time expires, so that
+ * old duplicates of its SYN can't open a new connection in its place.
+ */
+void stcp_enter_time_wait(mysocket_t sd, uint32_t peer_seq, uint64_t expires)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    DEBUG_LOG(("stcp_enter_time_wait(%d):  peer at %u\n", sd, peer_seq));
+    _mysock_enter_time_wait(ctx, peer_seq, expires);
+}
+
 /* allow STCP implementation to establish a context for a given mysocket
  * descriptor.  this context should contain any information that needs to be
  * tracked for the given mysocket, e.g. sequence numbers, retransmission
@@ -167,6 +266,28 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
     return len;
 }
 
+/* count the packets that have arrived from the peer so far; see
+ * stcp_api.h
+ */
+size_t stcp_network_recv_batch(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return _mysock_packets_waiting(ctx);
+}
+
+/* largest packet stcp_network_send() can deliver, as the network layer
+ * reports it
+ */
+size_t stcp_network_max_len(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return _network_max_packet_len(&ctx->network_state);
+}
+
 /* stcp_network_send()
  *
  * Send data to the peer.
@@ -188,7 +309,7 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
-    char              packet[MAX_IP_PAYLOAD_LEN];
+    char              packet[MAX_PACKET_LEN];
     size_t            packet_len;
     const void       *next_buf;
     va_list           argptr;
@@ -211,6 +332,8 @@ ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
     }
     va_end(argptr);
 
+    assert(packet_len <= _network_max_packet_len(&ctx->network_state));
+
     /* fill in fields in the TCP header that aren't handled by students */
     assert(packet_len >= sizeof(struct tcphdr));
     header = (struct tcphdr *) packet;
@@ -236,34 +359,99 @@ ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
+    size_t len;
+
     assert(ctx && dst);
 
-    /* app may have passed in data of arbitrary length; all of it must be
-     * passed down to the transport layer.  if it doesn't fit in the specified
-     * buffer, any left over is kept for the next call to app_recv().
+    if (byte_ring_count(&ctx->app_recv_ring) == 0)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        _mysock_set_waiter(&ctx->app_recv_ring.consumer_waiting, TRUE);
+        while (byte_ring_count(&ctx->app_recv_ring) == 0)
+        {
+            PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                           &ctx->data_ready_lock));
+        }
+        _mysock_set_waiter(&ctx->app_recv_ring.consumer_waiting, FALSE);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
+
+    /* the app's writes run together; whatever doesn't fit in dst is left
+     * for the next call to app_recv()
      */
-    return _mysock_dequeue_buffer(ctx, &ctx->app_recv_queue,
-                                  dst, max_len, TRUE);
+    len = byte_ring_read(&ctx->app_recv_ring, dst, max_len);
+
+    /* mywrite() may be waiting for the room */
+    _mysock_wake_waiter(ctx, &ctx->app_recv_ring.producer_waiting);
+    return len;
 }
 
-/* pass data up to the application for consumption by myread() */
+/* pass data up to the application for consumption by myread().  the ring
+ * has room for the largest window STCP offers, so this shouldn't have to
+ * wait for myread() to make room, but it will if it must rather than lose
+ * data already acknowledged.
+ */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
     assert(ctx && src);
-    if (src_len > 0)
+
+    DEBUG_LOG(("stcp_app_send(%d):  sending %u bytes up to app\n",
+               sd, src_len));
+
+    while (src_len > 0)
     {
-        DEBUG_LOG(("stcp_app_send(%d):  sending %u bytes up to app\n",
-                   sd, src_len));
-        _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, src, src_len);
+        size_t len = byte_ring_write(&ctx->app_send_ring, src, src_len);
+
+        src = (const char *) src + len;
+        src_len -= len;
+
+        if (len > 0)
+            _mysock_wake_waiter(ctx, &ctx->app_send_ring.consumer_waiting);
+
+        if (src_len > 0)
+        {
+            PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+            _mysock_set_waiter(&ctx->app_send_ring.producer_waiting, TRUE);
+            while (byte_ring_space(&ctx->app_send_ring) == 0)
+            {
+                PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                               &ctx->data_ready_lock));
+            }
+            _mysock_set_waiter(&ctx->app_send_ring.producer_waiting, FALSE);
+            PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        }
     }
 }
 
+/* bytes passed up to the application that myread() hasn't taken yet */
+size_t stcp_app_unread(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return byte_ring_count(&ctx->app_send_ring);
+}
+
 void stcp_fin_received(mysocket_t sd)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
     assert(ctx);
     DEBUG_LOG(("stcp_fin_received(%d):  setting eof flag\n", sd));
-    _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, NULL, 0);
+    _mysock_app_eof(ctx);
 }
 
+/* current value of a mysetsockopt() option */
+int stcp_get_option(mysocket_t sd, int option)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    int value;
+
+    assert(ctx);
+    assert(option >= 0 && option < MYSO_NUM_OPTIONS);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    value = ctx->options[option];
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    return value;
+}
@@ -17,7 +17,10 @@ typedef enum
     APP_DATA            = 1,
     NETWORK_DATA        = 2,
     APP_CLOSE_REQUESTED = 4,
-    ANY_EVENT           = APP_DATA | NETWORK_DATA | APP_CLOSE_REQUESTED
+    APP_OPTIONS_CHANGED = 8,
+    APP_DATA_CONSUMED   = 16,
+    ANY_EVENT           = APP_DATA | NETWORK_DATA | APP_CLOSE_REQUESTED |
+                          APP_OPTIONS_CHANGED | APP_DATA_CONSUMED
 } stcp_event_type_t;
 
 
@@ -28,6 +31,14 @@ typedef enum
  */
 void stcp_unblock_application(mysocket_t sd);
 
+/* called by the transport layer thread when an established connection has
+ * to be abandoned, e.g. because the peer stopped acknowledging data.  as
+ * with stcp_unblock_application(), errno should be set beforehand; once the
+ * application has read any data already passed up, myread() and mywrite()
+ * fail with that error.
+ */
+void stcp_abort_connection(mysocket_t sd);
+
 /* called by the transport layer to wait for new data, either from the network
  * or from the application, or for the application to request that the
  * socket be closed via myclose(), depending on the value of wait_flags.
@@ -37,7 +48,9 @@ void stcp_unblock_application(mysocket_t sd);
  * structure containing all zeros corresponds to 00:00:00 GMT, January 1,
  * 1970); if the timeout pointer is NULL, the function blocks indefinitely
  * until data arrives.  the close event is triggered only once, once all
- * pending data has been dequeued from the application.
+ * pending data has been dequeued from the application.  the options changed
+ * event is likewise reported once per burst of mysetsockopt() calls, and
+ * the data consumed event once per burst of myread() calls.
  *
  * sd is the mysocket descriptor for the connection of interest.
  *
@@ -56,11 +69,38 @@ void stcp_unblock_application(mysocket_t sd);
  * of the data waiting to be sent by the application, a subsequent call to
  * stcp_wait_for_event() (again with appropriate flags) will return
  * immediately with a pending event to be processed.
+ *
+ * the function also returns, with no bits set, once the connection's timer
+ * (see stcp_set_timer() below) expires; each expiry is reported once.
  */
 unsigned int stcp_wait_for_event(mysocket_t             sd,
                                  unsigned int           wait_flags,
                                  const struct timespec *abstime);
 
+/* returns the current time in microseconds on a monotonic clock, i.e. one
+ * that never jumps when the system time is set.  this is the clock
+ * stcp_set_timer() runs on; its origin is arbitrary.
+ */
+uint64_t stcp_current_time(void);
+
+/* sets the connection's timer to go off at time expires (as returned by
+ * stcp_current_time()), replacing any earlier setting; zero cancels it.
+ * the timers of all connections share one timer wheel, so setting and
+ * cancelling them are cheap enough to do on every pass of the control loop.
+ * timers fire no earlier than asked, and within a tenth of a millisecond.
+ */
+void stcp_set_timer(mysocket_t sd, uint64_t expires);
+
+/* called by the transport layer when it leaves a connection in TIME_WAIT,
+ * just before transport_init() returns.  peer_seq is the next sequence
+ * number expected from the peer, and expires (as for stcp_set_timer()) the
+ * end of TIME_WAIT.  until then a SYN from the same peer address and port
+ * is taken as an old duplicate, and dropped, unless its sequence number is
+ * beyond peer_seq.  only this much is kept of the connection; everything
+ * else is freed as usual once the application has called myclose().
+ */
+void stcp_enter_time_wait(mysocket_t sd, uint32_t peer_seq, uint64_t expires);
+
 /* allow STCP implementation to establish a context for a given mysocket
  * descriptor.  this context should contain any information that needs to be
  * tracked for the given mysocket, e.g. sequence numbers, retransmission
@@ -81,6 +121,19 @@ void *stcp_get_context(mysocket_t my_sd);
  */
 ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
 
+/* returns how many packets have arrived from the peer and not yet been
+ * received.  that many calls to stcp_network_recv() then return them in
+ * order without blocking.  packets pass from the network thread through a
+ * lock-free ring, so neither this nor those calls take a lock.
+ */
+size_t stcp_network_recv_batch(mysocket_t sd);
+
+/* returns the largest packet, STCP header and options included, that
+ * stcp_network_send() can deliver to the peer.  this depends on the
+ * underlying network layer, and bounds the segment size.
+ */
+size_t stcp_network_max_len(mysocket_t sd);
+
 /* Send data to the peer.
  *
  * sd           Mysocket descriptor
@@ -104,6 +157,11 @@ size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len);
 /* pass data up to the application for consumption by myread() */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len);
 
+/* returns the number of bytes passed up with stcp_app_send() that the
+ * application has not yet read
+ */
+size_t stcp_app_unread(mysocket_t sd);
+
 /* once you receive a FIN segment from the peer, we need to let the
  * application know there's no more data arriving (by returning 0 bytes for
  * subsequent myread() calls).  call stcp_fin_received() to indicate the
@@ -112,5 +170,14 @@ void stcp_app_send(mysocket_t sd, const void *src, size_t src_len);
  */
 void stcp_fin_received(mysocket_t sd);
 
+/* returns the current value of the given per-mysocket option (one of the
+ * mysockopt_t values in mysock.h).  the application may change options at
+ * any time with mysetsockopt(), and stcp_wait_for_event() then reports
+ * APP_OPTIONS_CHANGED.  this takes the mysocket's lock, so options needed
+ * on every segment are best copied when the connection starts and read
+ * again on that event, rather than looked up each time.
+ */
+int stcp_get_option(mysocket_t sd, int option);
+
 #endif  /* __STCP_API_H__ */
 
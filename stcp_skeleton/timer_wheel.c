@@ -0,0 +1,201 @@
+/* timer_wheel.c--hierarchical timing wheel */
+
+#include <assert.h>
+#include <string.h>
+#include "timer_wheel.h"
+
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/* ticks spanned by one slot of the given level */
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_BITS)
+
+/* ticks the whole wheel spans */
+#define WHEEL_RANGE \
+    ((uint64_t) 1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS))
+
+static void insert_timer(timer_wheel_t *wheel, wheel_timer_t *timer,
+                         uint64_t earliest);
+static void unlink_timer(wheel_timer_t *timer);
+static void cascade(timer_wheel_t *wheel, int level);
+static uint64_t next_event_tick(const timer_wheel_t *wheel);
+
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now)
+{
+    assert(wheel);
+
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now / TIMER_WHEEL_TICK;
+}
+
+void timer_wheel_arm(timer_wheel_t *wheel, wheel_timer_t *timer,
+                     uint64_t expires)
+{
+    uint64_t tick;
+
+    assert(wheel && timer && timer->callback);
+
+    /* round up, so the timer never fires early */
+    tick = (expires + TIMER_WHEEL_TICK - 1) / TIMER_WHEEL_TICK;
+    if (timer_wheel_armed(timer) && timer->expires == tick)
+        return;     /* already where it belongs */
+
+    timer_wheel_cancel(wheel, timer);
+    timer->expires = tick;
+    insert_timer(wheel, timer, wheel->now + 1);
+    wheel->count++;
+}
+
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+    assert(wheel && timer);
+
+    if (!timer_wheel_armed(timer))
+        return;
+
+    unlink_timer(timer);
+    assert(wheel->count > 0);
+    wheel->count--;
+}
+
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now)
+{
+    uint64_t target = now / TIMER_WHEEL_TICK;
+
+    assert(wheel);
+
+    while (wheel->now < target)
+    {
+        uint64_t tick = next_event_tick(wheel);
+        wheel_timer_t *timer;
+        int level;
+
+        /* nothing happens on the ticks in between */
+        if (!tick || tick > target)
+        {
+            wheel->now = target;
+            break;
+        }
+        wheel->now = tick;
+
+        /* each time a level comes round to slot 0, the next level's
+         * current slot is spread out over the levels below
+         */
+        for (level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+        {
+            if (tick & (((uint64_t) 1 << LEVEL_SHIFT(level)) - 1))
+                break;
+            cascade(wheel, level);
+        }
+
+        while ((timer = wheel->slots[0][tick & SLOT_MASK]) != NULL)
+        {
+            assert(timer->expires <= tick);
+            unlink_timer(timer);
+            wheel->count--;
+            timer->callback(timer->arg);
+        }
+    }
+}
+
+uint64_t timer_wheel_next_event(const timer_wheel_t *wheel)
+{
+    assert(wheel);
+    return next_event_tick(wheel) * TIMER_WHEEL_TICK;
+}
+
+/* hang the timer off the slot for its expiry: the lowest level whose range
+ * from now covers it.  timers due before the earliest tick still to be
+ * processed go in that tick's slot.
+ */
+static void insert_timer(timer_wheel_t *wheel, wheel_timer_t *timer,
+                         uint64_t earliest)
+{
+    uint64_t expires = timer->expires, delta;
+    wheel_timer_t **slot;
+    int level;
+
+    if (expires < earliest)
+        expires = earliest;
+    delta = expires - wheel->now;
+    if (delta >= WHEEL_RANGE)
+    {
+        /* out of range for now; filed again once it comes closer */
+        delta = WHEEL_RANGE - 1;
+        expires = wheel->now + delta;
+    }
+
+    for (level = 0;
+         delta >> LEVEL_SHIFT(level + 1) && level < TIMER_WHEEL_LEVELS - 1;
+         ++level)
+        ;
+
+    slot = &wheel->slots[level][(expires >> LEVEL_SHIFT(level)) & SLOT_MASK];
+    timer->next = *slot;
+    if (timer->next)
+        timer->next->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void unlink_timer(wheel_timer_t *timer)
+{
+    assert(timer->pprev);
+
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* re-file the timers in the given level's current slot, now that they are
+ * within range of the levels below.  those due on this very tick land in
+ * the level 0 slot about to be expired.
+ */
+static void cascade(timer_wheel_t *wheel, int level)
+{
+    wheel_timer_t **slot, *timer;
+
+    slot = &wheel->slots[level][(wheel->now >> LEVEL_SHIFT(level)) &
+                                SLOT_MASK];
+    while ((timer = *slot) != NULL)
+    {
+        unlink_timer(timer);
+        insert_timer(wheel, timer, wheel->now);
+    }
+}
+
+/* the first tick after now with a timer to fire or move down a level, or 0
+ * if the wheel is empty.  each level is checked for its next non-empty
+ * slot, which is dealt with when the wheel reaches that slot's first tick.
+ */
+static uint64_t next_event_tick(const timer_wheel_t *wheel)
+{
+    uint64_t best = 0;
+    int level, k;
+
+    if (!wheel->count)
+        return 0;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+    {
+        uint64_t position = wheel->now >> LEVEL_SHIFT(level);
+
+        for (k = 1; k <= TIMER_WHEEL_SLOTS; ++k)
+        {
+            if (wheel->slots[level][(position + k) & SLOT_MASK])
+            {
+                uint64_t tick = (position + k) << LEVEL_SHIFT(level);
+
+                if (!best || tick < best)
+                    best = tick;
+                break;
+            }
+        }
+    }
+
+    assert(best);
+    return best;
+}
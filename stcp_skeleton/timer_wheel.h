@@ -0,0 +1,74 @@
+/* timer_wheel.h--hierarchical timing wheel (Varghese and Lauck, "Hashed and
+ * Hierarchical Timing Wheels", SOSP 1987).
+ *
+ * timers hang off slots of a few wheels of increasing granularity: the
+ * lowest level has a slot per tick, and each level above covers the whole
+ * range of the one below in each of its slots.  arming and cancelling a
+ * timer are O(1); a timer is moved down a level each time the wheel below
+ * comes round to it, and fires from the lowest level on its tick.
+ *
+ * the wheel itself does no locking and knows nothing of clocks; its owner
+ * says what time it is when advancing it.
+ */
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include "mysock.h"   /* uint64_t, bool_t */
+
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS   6        /* 64 slots per level */
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+
+/* length of a tick (us).  timers fire on the first tick at or after their
+ * expiry time, so never early and at most a tick late.  the four levels span
+ * 64^4 ticks (about 28 minutes); later timers wait in the top level's
+ * furthest slot until they come within range.
+ */
+#define TIMER_WHEEL_TICK   100
+
+typedef struct wheel_timer
+{
+    /* set by the owner before arming */
+    void (*callback)(void *arg);
+    void *arg;
+
+    /* wheel bookkeeping.  pprev is NULL while the timer is not armed. */
+    struct wheel_timer  *next;
+    struct wheel_timer **pprev;
+    uint64_t             expires;   /* tick */
+} wheel_timer_t;
+
+typedef struct
+{
+    uint64_t       now;     /* last tick processed */
+    unsigned int   count;   /* timers armed */
+    wheel_timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+
+/* start an empty wheel at time now (us) */
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now);
+
+/* arm timer to fire at time expires (us), moving it if it is already armed */
+void timer_wheel_arm(timer_wheel_t *wheel, wheel_timer_t *timer,
+                     uint64_t expires);
+
+/* disarm timer; harmless if it is not armed */
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+
+#define timer_wheel_armed(timer) ((timer)->pprev != NULL)
+
+/* bring the wheel forward to time now (us), calling the callback of each
+ * timer that expires on the way.  a timer is disarmed before its callback
+ * runs, so the callback may arm it again.
+ */
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now);
+
+/* the time (us) by which timer_wheel_advance() next has work to do, either
+ * a timer expiring or one moving down a level; 0 if no timers are armed
+ */
+uint64_t timer_wheel_next_event(const timer_wheel_t *wheel);
+
+#endif  /* __TIMER_WHEEL_H__ */
@@ -19,13 +19,104 @@
 #include "mysock.h"
 #include "stcp_api.h"
 #include "transport.h"
+#include "congestion.h"
 #include <iostream>
 using namespace std;
 
-#define WINDOW_SIZE 3072
 #define MAX_SEQ_NUM 255
 #define HEADER_SIZE 20
 
+/* the send and reassembly buffers are sized from the socket's MYSO_SNDBUF
+ * and MYSO_RCVBUF, rounded up to a power of two no smaller than this
+ */
+#define MIN_BUFFER_SIZE 4096
+
+#if (MIN_BUFFER_SIZE & (MIN_BUFFER_SIZE - 1)) != 0
+	#error MIN_BUFFER_SIZE should be a power of two
+#endif
+
+/* largest window th_win can carry, and the largest shift applied to it
+ * (RFC 7323, section 2.3)
+ */
+#define TCP_MAXWIN 65535
+#define MAX_WSCALE 14
+
+/* receive window offered at first, before autotuning has measured how fast
+ * the application reads: as much as a SYN can describe
+ */
+#define INITIAL_RCV_WINDOW TCP_MAXWIN
+
+/* separate runs of out-of-order data the receiver will track */
+#define MAX_OOO_INTERVALS 16
+
+/* TCP options: at most 40 bytes follow the fixed header */
+#define MAX_OPTIONS_LEN 40
+#define TCPOPT_EOL            0
+#define TCPOPT_NOP            1
+#define TCPOPT_MAXSEG         2
+#define TCPOPT_WSCALE         3
+#define TCPOPT_SACK_PERMITTED 4
+#define TCPOPT_SACK           5
+
+/* a SACK option fits at most four blocks (RFC 2018) */
+#define MAX_SACK_BLOCKS 4
+
+/* the MSS we offer leaves room for a full set of options, so no segment
+ * outgrows what the network layer can carry
+ */
+#define LOCAL_MSS(max_packet_len) \
+	MIN((max_packet_len) - HEADER_SIZE - MAX_OPTIONS_LEN, (size_t)0xffff)
+
+/* retransmission timer bounds (RFC 6298), in microseconds.  the minimum is
+ * well below the RFC's conservative one second to keep tail latency down.
+ */
+#define RTO_INITIAL 1000000
+#define RTO_MIN     200000
+#define RTO_MAX     60000000
+
+/* consecutive timeouts of the same segment (or unanswered window probes)
+ * before the connection is abandoned with ETIMEDOUT
+ */
+#define MAX_RETRANSMISSIONS 8
+
+/* unanswered SYN (or SYN-ACK) retransmissions before the handshake is
+ * abandoned with ETIMEDOUT; like data, they back off from RTO_INITIAL
+ */
+#define MAX_SYN_RETRANSMISSIONS 5
+
+/* maximum segment lifetime (us).  the end that closes first stays in
+ * TIME_WAIT for twice this, but only as a tombstone in the mysocket layer.
+ */
+#define MSL 30000000
+
+/* the persist timer starts from the RTO and backs off to at most this (us) */
+#define PERSIST_MAX 60000000
+
+/* duplicate ACKs that trigger a fast retransmit (RFC 5681) */
+#define DUPACK_THRESHOLD 3
+
+/* initial congestion window (RFC 3390) */
+#define INITIAL_CWND(mss) MIN(4 * (mss), MAX(2 * (mss), 4380))
+
+/* packetization layer path MTU discovery (RFC 4821).  connections start
+ * out with segments of at most PLPMTUD_BASE_MSS bytes, which any sensible
+ * path carries, and probe upwards towards the MSS both ends agreed on.
+ * a probe size is given up on after PLPMTUD_MAX_PROBES losses; the search
+ * stops once less than PLPMTUD_MIN_RANGE bytes separate the largest size
+ * known to work from the largest that might, and starts over after
+ * PLPMTUD_INTERVAL (us) in case the path has changed.
+ */
+#define PLPMTUD_BASE_MSS   1024
+#define PLPMTUD_MAX_PROBES 3
+#define PLPMTUD_MIN_RANGE  32
+#define PLPMTUD_INTERVAL   600000000
+
+/* sequence number comparisons, safe across wraparound */
+#define SEQ_LT(a,b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a,b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a,b)  ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a,b) ((int32_t)((a) - (b)) >= 0)
+
 enum
 {
 	CSTATE_LISTEN,
@@ -38,9 +129,155 @@ enum
 	CSTATE_CLOSING,
 	CSTATE_LAST_ACK,
 	CSTATE_TIME_WAIT,
-	CSTATE_CLOSED
+	CSTATE_CLOSED,
+	NUM_CSTATES
+};
+
+/* what moves a connection from one state to the next */
+enum
+{
+	CEVENT_SYN,             /* the peer's SYN arrived (passive open) */
+	CEVENT_ESTABLISHED,     /* the handshake completed */
+	CEVENT_CLOSE,           /* our FIN went out */
+	CEVENT_FIN_ACKED,       /* the peer acknowledged our FIN */
+	CEVENT_FIN,             /* the peer's FIN arrived, in sequence */
+	CEVENT_ABORT,           /* the connection was abandoned */
+	NUM_CEVENTS
+};
+
+#define NO_TRANSITION (-1)
+
+/* one row of state_transitions: the next state on each event, in the
+ * order of the CEVENT_ values.  a row with an entry missing (or one too
+ * many) doesn't compile.
+ */
+#define TRANSITIONS(syn, established, close, fin_acked, fin, abort) \
+	{ syn, established, close, fin_acked, fin, abort }
+
+#define CS(state) CSTATE_##state
+#define NONE      NO_TRANSITION
+
+/* the connection state machine (RFC 793, figure 6), a row per state in
+ * the order of the CSTATE_ values.  NONE marks an event that can't happen
+ * in that state.  segments that don't change the state (duplicates, and
+ * retransmissions of a SYN or FIN we have already seen) never get here.
+ */
+static const signed char state_transitions[][NUM_CEVENTS] =
+{
+	/*                  SYN                ESTABLISHED      CLOSE
+	 *                  FIN_ACKED          FIN              ABORT */
+	/* LISTEN */
+	TRANSITIONS(CS(SYN_RECEIVED),  NONE,            NONE,
+	            NONE,              NONE,            CS(CLOSED)),
+	/* SYN_SENT */
+	TRANSITIONS(NONE,              CS(ESTABLISHED), NONE,
+	            NONE,              NONE,            CS(CLOSED)),
+	/* SYN_RECEIVED */
+	TRANSITIONS(NONE,              CS(ESTABLISHED), NONE,
+	            NONE,              NONE,            CS(CLOSED)),
+	/* ESTABLISHED */
+	TRANSITIONS(NONE,              NONE,            CS(FIN_WAIT_1),
+	            NONE,              CS(CLOSE_WAIT),  CS(CLOSED)),
+	/* FIN_WAIT_1 */
+	TRANSITIONS(NONE,              NONE,            NONE,
+	            CS(FIN_WAIT_2),    CS(CLOSING),     CS(CLOSED)),
+	/* FIN_WAIT_2 */
+	TRANSITIONS(NONE,              NONE,            NONE,
+	            NONE,              CS(TIME_WAIT),   CS(CLOSED)),
+	/* CLOSE_WAIT */
+	TRANSITIONS(NONE,              NONE,            CS(LAST_ACK),
+	            NONE,              NONE,            CS(CLOSED)),
+	/* CLOSING */
+	TRANSITIONS(NONE,              NONE,            NONE,
+	            CS(TIME_WAIT),     NONE,            CS(CLOSED)),
+	/* LAST_ACK */
+	TRANSITIONS(NONE,              NONE,            NONE,
+	            CS(CLOSED),        NONE,            CS(CLOSED)),
+	/* TIME_WAIT */
+	TRANSITIONS(NONE,              NONE,            NONE,
+	            NONE,              NONE,            CS(CLOSED)),
+	/* CLOSED */
+	TRANSITIONS(NONE,              NONE,            NONE,
+	            NONE,              NONE,            CS(CLOSED)),
 };
 
+#undef CS
+#undef NONE
+
+/* a state without a row, or a row too many, doesn't compile either */
+typedef char state_transitions_cover_every_state
+	[(sizeof(state_transitions) / sizeof(state_transitions[0]) ==
+	  NUM_CSTATES) ? 1 : -1];
+
+/* a segment that has been sent but not yet fully acknowledged.  the payload
+ * itself stays in the send buffer; only its position is recorded here.
+ */
+typedef struct segment
+{
+	tcp_seq seq;
+	size_t data_len;
+	uint8_t flags;          /* TH_FIN if the segment carries our FIN */
+	uint64_t sent_time;     /* time of the most recent transmission */
+	int transmissions;
+	bool_t lost;            /* presumed lost and awaiting retransmission */
+	bool_t sacked;          /* reported received by a SACK block */
+	bool_t probe;           /* a path MTU probe, larger than the MSS */
+	int loss_epoch;         /* recovery episode in which it was marked lost */
+
+	/* connection's delivery state when this was last sent, from which its
+	 * ACK derives a delivery rate sample
+	 */
+	uint64_t delivered;
+	uint64_t delivered_time;
+	uint64_t first_sent_time;
+	bool_t app_limited;
+
+	struct segment *next;
+} segment_t;
+
+/* segments are carved out of blocks of SEGMENT_BLOCK_LEN, allocated when
+ * the connection is established, so sending and acknowledging data
+ * allocates nothing.  see grow_segment_pool().
+ */
+#define SEGMENT_BLOCK_LEN 64
+
+typedef struct segment_block
+{
+	segment_t segments[SEGMENT_BLOCK_LEN];
+	struct segment_block *next;
+} segment_block_t;
+
+/* the delivery rate sample an ACK is building: the state recorded with the
+ * most recently sent segment it covers
+ */
+typedef struct
+{
+	bool_t valid;
+	uint64_t prior_delivered;
+	uint64_t prior_time;
+	uint64_t send_elapsed;
+	bool_t app_limited;
+} rate_sample_t;
+
+/* a run of sequence space [start, end) */
+typedef struct
+{
+	tcp_seq start;
+	tcp_seq end;
+} seq_interval_t;
+
+/* options found in an incoming segment */
+typedef struct
+{
+	uint16_t mss;           /* zero if no MSS option was present */
+	bool_t sack_permitted;
+	bool_t wscale_ok;       /* a window scale option was present */
+	int wscale;
+	int num_sack_blocks;
+	tcp_seq sack_start[MAX_SACK_BLOCKS];
+	tcp_seq sack_end[MAX_SACK_BLOCKS];
+} tcp_options_t;
+
 /* this structure is global to a mysocket descriptor */
 typedef struct
 {
@@ -53,24 +290,316 @@ typedef struct
 	tcp_seq receiver_next_seq;
 	tcp_seq sender_unack_seq;
 
-	uint16_t sender_window_size;
-	uint16_t receiver_window_size;
+	/* windows in bytes, after scaling.  with window scaling (RFC 7323)
+	 * agreed on the SYNs, th_win counts units of 1 << snd_wscale in the
+	 * peer's segments and of 1 << rcv_wscale in ours; SYNs are never
+	 * scaled.
+	 */
+	uint32_t sender_window_size;
+	uint32_t receiver_window_size;
+
+	/* segment sizing.  mss_ceiling is the smaller of what the peer asked
+	 * for in its MSS option (STCP_MSS if it sent none) and what the
+	 * network layer lets us offer; mss, the most data we put in an
+	 * ordinary segment, is as much of that as path MTU probing has shown
+	 * to get through.  rcv_mss is our estimate of the peer's: the largest
+	 * segment it has sent so far, or where its probing would start.
+	 * segments from the peer, up to max_packet_len bytes, are read into
+	 * segment_buf.  small_seg_end is where the last segment we sent short
+	 * of the MSS ended.
+	 */
+	uint32_t mss;
+	uint32_t mss_ceiling;
+	uint32_t rcv_mss;
+	size_t max_packet_len;
+	uint8_t *segment_buf;
+	tcp_seq small_seg_end;
+	bool_t wscale_ok;
+	int snd_wscale;
+	int rcv_wscale;
+
+	/* send buffer of send_buffer_size (a power of two) bytes.  bytes from
+	 * sender_unack_seq up to send_buffer_end have been taken from the
+	 * application; those before sender_next_seq are in flight, the rest
+	 * are waiting for window space.  a byte with sequence number seq lives
+	 * at SEND_BUFFER_INDEX(ctx, seq).
+	 */
+	uint8_t *send_buffer;
+	uint32_t send_buffer_size;
+	tcp_seq send_buffer_end;
+
+	/* retransmission queue, oldest segment first, doubling as the SACK
+	 * scoreboard.  lost_bytes counts the sequence space of segments marked
+	 * lost but not yet resent, sacked_bytes that of segments the peer has
+	 * selectively acknowledged.
+	 */
+	segment_t *retransmit_head;
+	segment_t *retransmit_tail;
+	uint32_t lost_bytes;
+	uint32_t sacked_bytes;
+	int loss_epoch;
+
+	/* pool of retransmission queue entries: the unused ones, linked
+	 * through next, and the blocks they were all carved from
+	 */
+	segment_t *free_segments;
+	segment_block_t *segment_blocks;
+
+	/* selective acknowledgments (RFC 2018), if both ends offered them */
+	bool_t sack_permitted;
+
+	/* reassembly.  data beyond receiver_next_seq (and within the window)
+	 * is copied to recv_buffer at RECV_BUFFER_INDEX(ctx, seq);
+	 * ooo_intervals is the sorted set of disjoint runs held there.
+	 * last_ooo_seq is the most recent arrival, reported in the first SACK
+	 * block.  the buffer is never smaller than the window we advertise.
+	 */
+	uint8_t *recv_buffer;
+	uint32_t recv_buffer_size;
+	seq_interval_t ooo_intervals[MAX_OOO_INTERVALS];
+	int num_ooo_intervals;
+	tcp_seq last_ooo_seq;
+
+	/* receive window.  we offer rcv_space_target less whatever the
+	 * application has yet to read, so that unread data and the window
+	 * together stay within the target.  the right edge last advertised,
+	 * rcv_adv, never moves back, and only moves forward in worthwhile
+	 * steps (receiver silly window syndrome avoidance, RFC 1122).
+	 *
+	 * the target grows, up to rcv_window_clamp, to twice what the
+	 * application reads in a round trip (dynamic right-sizing), keeping
+	 * the window ahead of the sender.  rcv_space is the most read in one
+	 * round trip so far, counted from rcv_space_seq at rcv_space_time.
+	 * rcv_rtt is the round trip as the receiver sees it: the time the
+	 * sender takes to fill the window, from rcv_rtt_time until rcv_rtt_seq
+	 * arrives.
+	 */
+	uint32_t rcv_space_target;
+	uint32_t rcv_window_clamp;
+	tcp_seq rcv_adv;
+	uint32_t rcv_space;
+	tcp_seq rcv_space_seq;
+	uint64_t rcv_space_time;
+	uint32_t rcv_rtt;
+	tcp_seq rcv_rtt_seq;
+	uint64_t rcv_rtt_time;
+
+	/* the peer's FIN, once seen; it is processed when all data before it
+	 * has been delivered
+	 */
+	bool_t peer_fin_seen;
+	tcp_seq peer_fin_seq;
+
+	/* delayed ACKs (RFC 1122).  ack_pending_bytes of in-order data have
+	 * arrived since we last sent an ACK, and one must go out by
+	 * ack_deadline (zero if none is owed).  ack_now asks for one at the
+	 * end of this wakeup, unless a data segment carries it first.
+	 */
+	uint32_t ack_pending_bytes;
+	uint64_t ack_deadline;
+	bool_t ack_now;
+
+	/* congestion control and loss recovery.  the window is managed by the
+	 * module selected with MYSO_CONGESTION, except during NewReno fast
+	 * recovery (RFC 6582), when it follows proportional rate reduction
+	 * (RFC 6937) down to the module's ssthresh.
+	 */
+	congestion_t cc;
+	int cc_algorithm;       /* MYSO_CONGESTION value cc was set up for */
+	int dupacks;            /* duplicate ACKs since the last new ACK */
+	bool_t in_recovery;
+	tcp_seq recover_seq;    /* recovery ends once this has been ACKed */
+	uint32_t recover_fs;    /* flight size when recovery started */
+	uint32_t prr_delivered; /* bytes delivered to the peer during recovery */
+	uint32_t prr_out;       /* bytes sent during recovery */
+
+	/* path MTU probing.  segments of mtu_search_low bytes are known to get
+	 * through, and mtu_search_high is the largest size that still might.
+	 * a probe of probe_size bytes is outstanding unless probe_size is
+	 * zero; probe_failures counts the losses of probes of that size so
+	 * far.  once the search has converged below the ceiling it is repeated
+	 * at probe_timer.  while a recovery phase is only repairing a lost
+	 * probe (probe_recovery), ssthresh is parked in probe_prior_ssthresh
+	 * so the window comes through unharmed.
+	 */
+	uint32_t mtu_search_low;
+	uint32_t mtu_search_high;
+	uint32_t probe_size;
+	int probe_failures;
+	uint64_t probe_timer;
+	bool_t probe_recovery;
+	uint32_t probe_prior_ssthresh;
+
+	/* pacing, if the congestion control module asks for it: no new
+	 * segment leaves before next_send_time (us).  pacing_wait is set while
+	 * data is being held back for it.
+	 */
+	uint64_t next_send_time;
+	bool_t pacing_wait;
+
+	/* delivery rate estimation.  delivered counts bytes the peer has
+	 * acknowledged, cumulatively or by SACK, and delivered_time is when it
+	 * last grew.  first_sent_time is the send time of the segment behind
+	 * the latest sample.  while the application rather than the network
+	 * limits sending, app_limited is the delivered count at which that
+	 * ends (zero otherwise).
+	 */
+	uint64_t delivered;
+	uint64_t delivered_time;
+	uint64_t first_sent_time;
+	uint64_t app_limited;
+
+	/* RFC 6298 round-trip estimator and retransmission timer (all times in
+	 * microseconds).  rto_deadline is zero while the timer is stopped.
+	 */
+	bool_t rtt_valid;       /* TRUE once the first RTT sample is in */
+	uint32_t srtt;
+	uint32_t rttvar;
+	uint32_t rto;
+	uint64_t rto_deadline;
+	int retransmit_count;   /* consecutive timeouts without progress */
+
+	/* persist timer (RFC 1122, section 4.2.2.17).  while the peer's window
+	 * is shut with data waiting, it stands in for the retransmission
+	 * timer: at persist_deadline a one-byte window probe goes out, and the
+	 * interval doubles with every probe (persist_backoff).  persist_probes
+	 * counts the probes the peer hasn't answered.
+	 */
+	uint64_t persist_deadline;
+	int persist_backoff;
+	int persist_probes;
+
+	/* keepalive (RFC 1122, section 4.2.3.6), with the MYSO_KEEPALIVE
+	 * settings in us; keepalive_idle is zero while it is off.  the first
+	 * probe goes out keepalive_idle after last_heard, if nothing of ours
+	 * is outstanding by then, and the rest keepalive_intvl apart.
+	 * keepalive_probes counts the probes the peer hasn't answered.
+	 */
+	uint64_t keepalive_idle;
+	uint64_t keepalive_intvl;
+	int keepalive_count;
+	uint64_t last_heard;    /* when the last segment from the peer came in */
+	uint64_t keepalive_deadline;
+	int keepalive_probes;
+
+	/* the socket options the data path consults on every segment, read
+	 * once at the start and again whenever the application changes
+	 * options, instead of being looked up under the socket's lock each
+	 * time.  ack_delay is MYSO_ACK_DELAY in us.
+	 */
+	uint64_t ack_delay;
+	bool_t nodelay;         /* MYSO_NODELAY */
+	bool_t cork;            /* MYSO_CORK */
+	bool_t autocork;        /* MYSO_AUTOCORK */
+
+	/* connection teardown */
+	bool_t fin_pending;     /* app has closed; FIN goes out once data drains */
+	bool_t fin_sent;
+	tcp_seq fin_seq;        /* sequence number occupied by our FIN */
 
 	/* any other connection-wide global variables go here */
 } context_t;
 
+/* sequence space occupied by a queued segment */
+#define SEGMENT_SEQ_LEN(s) ((s)->data_len + (((s)->flags & TH_FIN) ? 1 : 0))
+
+/* position of the byte with sequence number seq in the send buffer; the
+ * first data byte follows the SYN, so it sits at index 0.
+ */
+#define SEND_BUFFER_INDEX(ctx, seq) \
+	(((seq) - (ctx)->initial_sequence_num - 1) & ((ctx)->send_buffer_size - 1))
+
+/* in-order data we may receive before an ACK has to be sent: RFC 1122
+ * asks for at least every second full-sized segment to be acknowledged
+ */
+#define ACK_EVERY_BYTES(ctx) (2 * (ctx)->rcv_mss)
+
+/* position of the byte with sequence number seq in the reassembly buffer */
+#define RECV_BUFFER_INDEX(ctx, seq) ((seq) & ((ctx)->recv_buffer_size - 1))
+
 
 static void generate_initial_seq_num(context_t *ctx);
+static ssize_t handshake(mysocket_t sd, context_t *ctx, bool_t is_active,
+                         tcp_options_t *peer_options);
+static bool_t send_syn(mysocket_t sd, context_t *ctx);
+static uint32_t buffer_size(int requested, uint32_t mss);
+static uint16_t advertised_window(const context_t *ctx, bool_t syn);
+static size_t write_syn_options(const context_t *ctx, uint8_t *options);
+static size_t write_sack_option(const context_t *ctx, uint8_t *options);
+static void parse_options(const STCPHeader *header, tcp_options_t *options);
 static void control_loop(mysocket_t sd, context_t *ctx);
-void close_connection_recv(mysocket_t sd, context_t *ctx, STCPHeader *fin_packet);
-void close_connection_send(mysocket_t sd, context_t *ctx, STCPHeader *fin_packet);
-void clear_header(tcphdr *header);
-
-void handshake_err_handling(mysocket_t sd)
-{
-	errno = ECONNREFUSED;
-	stcp_unblock_application(sd);
-}
+static void fill_send_buffer(mysocket_t sd, context_t *ctx);
+static bool_t app_data_queued(mysocket_t sd);
+static void send_pending_data(mysocket_t sd, context_t *ctx);
+static bool_t hold_partial_segment(const context_t *ctx);
+static bool_t pacing_allows(context_t *ctx);
+static void pacing_update(context_t *ctx, size_t len);
+static void send_segment(mysocket_t sd, context_t *ctx, tcp_seq seq,
+                         uint8_t flags, size_t data_len);
+static void send_new_segment(mysocket_t sd, context_t *ctx, tcp_seq seq,
+                             uint8_t flags, size_t data_len);
+static void retransmit_segment(mysocket_t sd, context_t *ctx,
+                               segment_t *segment);
+static void split_segment(context_t *ctx, segment_t *segment);
+static uint32_t next_probe_size(context_t *ctx, uint32_t in_flight);
+static void mtu_probe_succeeded(context_t *ctx);
+static uint32_t rescale_window(uint32_t window, uint32_t old_mss,
+                               uint32_t new_mss);
+static void mtu_probe_failed(context_t *ctx, segment_t *segment);
+static void handle_network_segments(mysocket_t sd, context_t *ctx);
+static void handle_network_segment(mysocket_t sd, context_t *ctx);
+static void process_segment(mysocket_t sd, context_t *ctx, size_t segment_len);
+static bool_t header_prediction(mysocket_t sd, context_t *ctx,
+                                const STCPHeader *header, size_t data_len,
+                                uint64_t now);
+static void receive_data(mysocket_t sd, context_t *ctx, tcp_seq seq,
+                         const uint8_t *data, size_t data_len, bool_t fin);
+static void hold_out_of_order(context_t *ctx, tcp_seq seq,
+                              const uint8_t *data, size_t data_len);
+static void copy_to_recv_buffer(context_t *ctx, tcp_seq seq,
+                                const uint8_t *data, size_t len);
+static void deliver_held_data(mysocket_t sd, context_t *ctx);
+static void update_receive_window(mysocket_t sd, context_t *ctx);
+static void receive_window_opened(mysocket_t sd, context_t *ctx);
+static void rcv_space_adjust(context_t *ctx, uint32_t unread);
+static void rcv_rtt_measure(context_t *ctx, uint64_t now);
+static void schedule_ack(context_t *ctx, size_t data_len, bool_t immediate);
+static void process_ack(context_t *ctx, const STCPHeader *header,
+                        size_t data_len, uint64_t now);
+static uint64_t remove_acked_segments(context_t *ctx, tcp_seq ack,
+                                      rate_sample_t *rs, uint64_t now);
+static uint32_t ack_advanced(context_t *ctx, uint64_t sample_time,
+                             uint64_t now);
+static uint32_t process_sack_blocks(context_t *ctx,
+                                    const tcp_options_t *options,
+                                    rate_sample_t *rs, uint64_t now);
+static void rate_on_send(context_t *ctx, segment_t *segment, uint64_t now);
+static void rate_on_delivered(context_t *ctx, rate_sample_t *rs,
+                              const segment_t *segment, uint64_t now);
+static void congestion_on_ack(context_t *ctx, congestion_ack_t *sample,
+                              const rate_sample_t *rs);
+static void mark_sack_losses(context_t *ctx);
+static void process_duplicate_ack(context_t *ctx, uint32_t newly_sacked);
+static void enter_recovery(context_t *ctx);
+static void prr_update(context_t *ctx, uint32_t delivered);
+static void mark_lost(context_t *ctx, segment_t *segment);
+static uint32_t bytes_in_flight(const context_t *ctx);
+static void update_rto(context_t *ctx, uint32_t rtt);
+static void retransmit_timeout(mysocket_t sd, context_t *ctx);
+static void update_persist_timer(context_t *ctx);
+static uint64_t persist_interval(const context_t *ctx);
+static void persist_timeout(mysocket_t sd, context_t *ctx);
+static void read_socket_options(mysocket_t sd, context_t *ctx);
+static void update_keepalive_timer(context_t *ctx);
+static void keepalive_timeout(mysocket_t sd, context_t *ctx);
+static void connection_timed_out(mysocket_t sd, context_t *ctx);
+static void change_state(context_t *ctx, int event);
+static void free_retransmit_queue(context_t *ctx);
+static void grow_segment_pool(context_t *ctx, size_t count);
+static segment_t *alloc_segment(context_t *ctx);
+static void release_segment(context_t *ctx, segment_t *segment);
+static void free_segment_pool(context_t *ctx);
+static void process_fin(mysocket_t sd, context_t *ctx);
 
 /* initialise the transport layer, and start the main loop, handling
 * any data from the peer or the application.  this function should not
@@ -79,6 +608,8 @@ void handshake_err_handling(mysocket_t sd)
 void transport_init(mysocket_t sd, bool_t is_active)
 {
 	context_t *ctx;
+	tcp_options_t peer_options;
+	ssize_t segment_len;
 
 	ctx = (context_t *)calloc(1, sizeof(context_t));
 	assert(ctx);
@@ -87,121 +618,508 @@ void transport_init(mysocket_t sd, bool_t is_active)
 
 	ctx->sender_next_seq = ctx->initial_sequence_num;
 	ctx->sender_unack_seq = ctx->initial_sequence_num;
-	ctx->receiver_window_size = WINDOW_SIZE;
+	ctx->max_packet_len = stcp_network_max_len(sd);
+	ctx->mss = LOCAL_MSS(ctx->max_packet_len);
+	ctx->segment_buf = (uint8_t *)malloc(ctx->max_packet_len);
+	assert(ctx->segment_buf);
+	ctx->send_buffer_size = buffer_size(stcp_get_option(sd, MYSO_SNDBUF),
+	                                    ctx->mss);
+	ctx->recv_buffer_size = buffer_size(stcp_get_option(sd, MYSO_RCVBUF),
+	                                    ctx->mss);
+	ctx->rcv_space_target = MIN(ctx->recv_buffer_size, INITIAL_RCV_WINDOW);
+	ctx->receiver_window_size = ctx->rcv_space_target;
+	ctx->rto = RTO_INITIAL;
+
+	/* the shift we offer is the smallest that lets th_win describe the
+	 * whole reassembly buffer
+	 */
+	while (ctx->rcv_wscale < MAX_WSCALE &&
+	       (ctx->recv_buffer_size >> ctx->rcv_wscale) > TCP_MAXWIN)
+		ctx->rcv_wscale++;
+
+	/* offer SACK and window scaling; the peer's SYN-ACK says whether it
+	 * agrees.  the passive end agrees only to what the peer's SYN offers.
+	 */
+	if (is_active)
+	{
+		ctx->sack_permitted = TRUE;
+		ctx->wscale_ok = TRUE;
+	}
+
+	if ((segment_len = handshake(sd, ctx, is_active, &peer_options)) < 0)
+	{
+		/* errno says why; the application sees it from myconnect(), while
+		 * myaccept() discards the connection
+		 */
+		stcp_unblock_application(sd);
+		free(ctx->segment_buf);
+		free(ctx);
+		return;
+	}
+
+	/* from here on windows are scaled, if both ends agreed to it; without
+	 * scaling our window must fit in th_win as it is
+	 */
+	if (ctx->wscale_ok)
+		ctx->snd_wscale = MIN(peer_options.wscale, MAX_WSCALE);
+	ctx->rcv_window_clamp = MIN(ctx->recv_buffer_size,
+	                            (uint32_t)TCP_MAXWIN << ctx->rcv_wscale);
+
+	/* room for a few segments at least, however large they are */
+	ctx->rcv_space_target = MAX(ctx->rcv_space_target, 4 * ctx->mss);
+	ctx->rcv_space_target = MIN(ctx->rcv_space_target, ctx->rcv_window_clamp);
+	ctx->receiver_window_size = ctx->rcv_space_target;
+	ctx->rcv_adv = ctx->receiver_next_seq + ctx->receiver_window_size;
+	ctx->rcv_space_seq = ctx->receiver_next_seq;
+	ctx->rcv_space_time = stcp_current_time();
+
+	ctx->mss_ceiling = MIN(ctx->mss,
+	                       peer_options.mss ? peer_options.mss : STCP_MSS);
+	ctx->mss = MIN(ctx->mss_ceiling, (uint32_t)PLPMTUD_BASE_MSS);
+	ctx->rcv_mss = ctx->mss;
+	ctx->mtu_search_low = ctx->mss;
+	ctx->mtu_search_high = ctx->mss_ceiling;
+	ctx->cc.mss = ctx->mss;
+	ctx->cc.cwnd = INITIAL_CWND(ctx->mss);
+	ctx->cc.ssthresh = ~(uint32_t)0;
+	ctx->cc_algorithm = stcp_get_option(sd, MYSO_CONGESTION);
+	congestion_init(&ctx->cc, congestion_lookup(ctx->cc_algorithm));
+	read_socket_options(sd, ctx);
+	ctx->last_heard = stcp_current_time();
+
+	ctx->send_buffer = (uint8_t *)malloc(ctx->send_buffer_size);
+	ctx->recv_buffer = (uint8_t *)malloc(ctx->recv_buffer_size);
+	assert(ctx->send_buffer && ctx->recv_buffer);
+
+	/* enough segments for a full send buffer at this MSS, and a FIN */
+	grow_segment_pool(ctx, ctx->send_buffer_size / ctx->mss + 1);
+
+	ctx->sender_unack_seq = ctx->sender_next_seq;
+	ctx->send_buffer_end = ctx->sender_next_seq;
+	ctx->small_seg_end = ctx->sender_next_seq;
+	change_state(ctx, CEVENT_ESTABLISHED);
+
+	/* the active end completes the handshake with an ACK, and the passive
+	 * end may have been handed the peer's first data along with it
+	 */
+	if (segment_len > 0)
+		process_segment(sd, ctx, segment_len);
+	if (is_active || ctx->ack_now)
+		send_segment(sd, ctx, ctx->sender_next_seq, TH_ACK, 0);
+
+	stcp_unblock_application(sd);
+
+	control_loop(sd, ctx);
+
+	/* having closed first, we leave behind only what it takes to turn
+	 * away old duplicates of the peer's SYN for 2*MSL
+	 */
+	if (ctx->connection_state == CSTATE_TIME_WAIT)
+		stcp_enter_time_wait(sd, ctx->receiver_next_seq,
+		                     stcp_current_time() + 2 * (uint64_t)MSL);
+
+	/* do any cleanup here */
+	free_retransmit_queue(ctx);
+	free_segment_pool(ctx);
+	free(ctx->send_buffer);
+	free(ctx->recv_buffer);
+	free(ctx->segment_buf);
+	free(ctx);
+}
+
+
+/* generate random initial sequence number for an STCP connection */
+static void generate_initial_seq_num(context_t *ctx)
+{
+	assert(ctx);
+
+#ifdef FIXED_INITNUM
+	/* please don't change this! */
+	ctx->initial_sequence_num = 1;
+#else
+	srand(*(unsigned int *)&ctx);
+	ctx->initial_sequence_num = rand() % (MAX_SEQ_NUM+1);
+#endif
+}
 
-	/* XXX: you should send a SYN packet here if is_active, or wait for one
-	* to arrive if !is_active.  after the handshake completes, unblock the
-	* application with stcp_unblock_application(sd).  you may also use
-	* this to communicate an error condition back to the application, e.g.
-	* if connection fails; to do so, just set errno appropriately (e.g. to
-	* ECONNREFUSED, etc.) before calling the function.
-	*/
 
-	STCPHeader *header_packet; /* See STCPHeader in transport.h */
-	header_packet = (STCPHeader *)calloc(1, sizeof(STCPHeader));
-	assert(header_packet);
+/* run the three-way handshake until the connection is established.  our
+ * SYN (or SYN-ACK) is resent each time the retransmission timer expires,
+ * backing off as data does.  the handshake is abandoned with ETIMEDOUT
+ * after MAX_SYN_RETRANSMISSIONS or once MYSO_CONNECT_TIMEOUT has passed;
+ * on the passive end this reaps a half-open connection whose peer has gone
+ * away.  returns the length of the segment in segment_buf that completed
+ * the handshake, if it is one the control loop should see, zero if not,
+ * or -1 (with errno set) on failure.
+ */
+static ssize_t handshake(mysocket_t sd, context_t *ctx, bool_t is_active,
+                         tcp_options_t *peer_options)
+{
+	STCPHeader *header = (STCPHeader *)ctx->segment_buf;
+	uint64_t now, syn_time = 0, give_up = 0;
+	int timeout_ms, retransmissions = 0;
+	ssize_t segment_len;
+
+	assert(ctx && peer_options);
+
+	now = stcp_current_time();
+	if ((timeout_ms = stcp_get_option(sd, MYSO_CONNECT_TIMEOUT)) > 0)
+		give_up = now + (uint64_t)timeout_ms * 1000;
 
 	if (is_active)
 	{
-		header_packet->th_seq = htonl(ctx->sender_next_seq);
-		header_packet->th_flags = TH_SYN;
-		header_packet->th_win = htons(ctx->receiver_window_size);
+		ctx->connection_state = CSTATE_SYN_SENT;
+		if (!send_syn(sd, ctx))
+			goto refused;
+		syn_time = now;
+		ctx->rto_deadline = now + ctx->rto;
+	}
+	else
+	{
+		/* the peer's SYN is already queued for us */
+		ctx->connection_state = CSTATE_LISTEN;
+	}
+
+	for (;;)
+	{
+		uint64_t wakeup;
+		uint8_t flags;
 
-		if (stcp_network_send(sd, header_packet, sizeof(STCPHeader), NULL) == -1)
+		wakeup = ctx->rto_deadline;
+		if (give_up && (!wakeup || give_up < wakeup))
+			wakeup = give_up;
+		stcp_set_timer(sd, wakeup);
+
+		if (!(stcp_wait_for_event(sd, NETWORK_DATA, NULL) & NETWORK_DATA))
 		{
-			handshake_err_handling(sd);
-			return;
-		}
+			now = stcp_current_time();
+			if (give_up && now >= give_up)
+			{
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			if (!ctx->rto_deadline || now < ctx->rto_deadline)
+				continue;
 
-		ctx->connection_state = CSTATE_SYN_SENT;
+			if (retransmissions++ == MAX_SYN_RETRANSMISSIONS)
+			{
+				errno = ETIMEDOUT;
+				return -1;
+			}
 
-		if ((size_t)stcp_network_recv(sd, header_packet, sizeof(STCPHeader)) < sizeof(STCPHeader)) {
-			handshake_err_handling(sd);
-			return;
+			dprintf("retransmitting %s, attempt %d\n",
+			        is_active ? "SYN" : "SYN-ACK", retransmissions);
+			if (!send_syn(sd, ctx))
+				goto refused;
+			ctx->rto = MIN(2 * ctx->rto, (uint32_t)RTO_MAX);
+			ctx->rto_deadline = now + ctx->rto;
+			continue;
 		}
 
-		/* Need to check that SYN and ACK are both set */
-		if (header_packet->th_flags != (TH_SYN | TH_ACK))
+		segment_len = stcp_network_recv(sd, ctx->segment_buf,
+		                                ctx->max_packet_len);
+		if (segment_len <= 0)
+			goto refused;
+		if (segment_len < (ssize_t)sizeof(STCPHeader) ||
+		    TCP_DATA_START(header) < sizeof(STCPHeader) ||
+		    TCP_DATA_START(header) > (size_t)segment_len)
+			continue;
+
+		flags = header->th_flags & (TH_SYN | TH_ACK);
+
+		if (ctx->connection_state == CSTATE_LISTEN)
 		{
-			handshake_err_handling(sd);
-			return;
-		}
+			if (flags != TH_SYN)
+				continue;
+
+			/* agree to SACK and window scaling only if the peer offered
+			 * them
+			 */
+			parse_options(header, peer_options);
+			ctx->sack_permitted = peer_options->sack_permitted;
+			ctx->wscale_ok = peer_options->wscale_ok;
+			if (!ctx->wscale_ok)
+				ctx->rcv_wscale = 0;
 
-		header_packet->th_flags = TH_ACK;
-		ctx->receiver_next_seq = ntohl(header_packet->th_seq) + 1;
-		ctx->sender_next_seq = ntohl(header_packet->th_ack);
-		header_packet->th_seq = htonl(ctx->sender_next_seq);
-		header_packet->th_ack = htonl(ctx->receiver_next_seq);
+			ctx->receiver_next_seq = ntohl(header->th_seq) + 1;
+			ctx->sender_window_size = ntohs(header->th_win);
 
-		if (stcp_network_send(sd, header_packet, sizeof(STCPHeader), NULL) == -1)
+			change_state(ctx, CEVENT_SYN);
+			if (!send_syn(sd, ctx))
+				goto refused;
+			syn_time = stcp_current_time();
+			ctx->rto_deadline = syn_time + ctx->rto;
+		}
+		else if (ctx->connection_state == CSTATE_SYN_RECEIVED &&
+		         flags == TH_SYN)
 		{
-			handshake_err_handling(sd);
-			return;
+			/* the peer resent its SYN, so our SYN-ACK was lost.  answer
+			 * at once, leaving the timer alone.
+			 */
+			if (!send_syn(sd, ctx))
+				goto refused;
+		}
+		else if (flags == (ctx->connection_state == CSTATE_SYN_SENT ?
+		                   (TH_SYN | TH_ACK) : TH_ACK) &&
+		         ntohl(header->th_ack) == ctx->initial_sequence_num + 1)
+		{
+			break;
 		}
 	}
-	else /* Passive end of the connection */
+
+	/* our SYN occupies one sequence number */
+	ctx->sender_next_seq = ctx->initial_sequence_num + 1;
+
+	if (ctx->connection_state == CSTATE_SYN_SENT)
 	{
-		ctx->connection_state = CSTATE_LISTEN;
+		parse_options(header, peer_options);
+		ctx->sack_permitted = peer_options->sack_permitted;
+		ctx->wscale_ok = peer_options->wscale_ok;
+		if (!ctx->wscale_ok)
+			ctx->rcv_wscale = 0;
 
-		if ((size_t)stcp_network_recv(sd, header_packet, sizeof(STCPHeader)) < sizeof(STCPHeader))
-		{
-			handshake_err_handling(sd);
-			return;
-		}
+		ctx->receiver_next_seq = ntohl(header->th_seq) + 1;
+		ctx->sender_window_size = ntohs(header->th_win);
+	}
 
-		ctx->connection_state = CSTATE_SYN_RECEIVED;
+	/* the handshake gives the first RTT sample, unless Karn's rule rules
+	 * it out; after a retransmission, data starts over from RTO_INITIAL
+	 * rather than the backed-off timer.
+	 */
+	now = stcp_current_time();
+	if (!retransmissions && now > syn_time)
+		update_rto(ctx, (uint32_t)(now - syn_time));
+	else
+		ctx->rto = RTO_INITIAL;
+	ctx->rto_deadline = 0;
 
-		ctx->receiver_next_seq = ntohl(header_packet->th_seq) + 1;
-		ctx->sender_window_size = MIN(ntohs(header_packet->th_win), WINDOW_SIZE);
+	/* the ACK completing a passive open may carry the peer's first data,
+	 * or even its FIN, if an ACK without them was lost
+	 */
+	if (ctx->connection_state == CSTATE_SYN_RECEIVED &&
+	    ((size_t)segment_len > TCP_DATA_START(header) ||
+	     (header->th_flags & TH_FIN)))
+		return segment_len;
+	return 0;
 
-		/* Next step is to check that SYN flag is set in received header (header_packet) */
-		/* If so, set SYN and ACK flags and send message back to client */
-		if (header_packet->th_flags == TH_SYN) {
-			header_packet->th_flags = TH_SYN + TH_ACK;
-			header_packet->th_seq = htonl(ctx->sender_next_seq);
-			header_packet->th_ack = htonl(ctx->receiver_next_seq);
-			if (stcp_network_send(sd, header_packet, sizeof(STCPHeader), NULL) == -1)
-			{
-				handshake_err_handling(sd);
-				return;
-			}
+refused:
+	/* the network layer couldn't reach the peer */
+	errno = ECONNREFUSED;
+	return -1;
+}
+
+/* send our SYN, or our SYN-ACK once the peer's SYN is in; returns FALSE if
+ * the network layer couldn't reach the peer
+ */
+static bool_t send_syn(mysocket_t sd, context_t *ctx)
+{
+	uint8_t header_buf[HEADER_SIZE + MAX_OPTIONS_LEN];
+	STCPHeader *header = (STCPHeader *)header_buf;
+	size_t options_len;
+
+	assert(ctx);
+
+	memset(header, 0, sizeof(STCPHeader));
+	options_len = write_syn_options(ctx, header_buf + sizeof(STCPHeader));
+	header->th_seq = htonl(ctx->initial_sequence_num);
+	header->th_flags = TH_SYN;
+	if (ctx->connection_state == CSTATE_SYN_RECEIVED)
+	{
+		header->th_flags |= TH_ACK;
+		header->th_ack = htonl(ctx->receiver_next_seq);
+	}
+	header->th_off = 5 + options_len / sizeof(uint32_t);
+	header->th_win = htons(advertised_window(ctx, TRUE));
+
+	return stcp_network_send(sd, header_buf,
+	                         sizeof(STCPHeader) + options_len, NULL) != -1;
+}
 
-			if ((size_t)stcp_network_recv(sd, header_packet, sizeof(STCPHeader)) < sizeof(STCPHeader))
+/* the buffer size to use for a MYSO_SNDBUF or MYSO_RCVBUF value: the next
+ * power of two, so that sequence numbers map onto the ring with a mask, and
+ * enough for a few segments of mss bytes
+ */
+static uint32_t buffer_size(int requested, uint32_t mss)
+{
+	uint32_t size = MIN_BUFFER_SIZE;
+	uint32_t wanted = MAX((uint32_t)requested, 4 * mss);
+
+	while (size < wanted && size < MYSO_MAX_BUFFER_SIZE)
+		size <<= 1;
+	return size;
+}
+
+/* th_win for a segment we send; only SYNs go unscaled */
+static uint16_t advertised_window(const context_t *ctx, bool_t syn)
+{
+	uint32_t window;
+
+	assert(ctx);
+
+	window = ctx->receiver_window_size;
+	if (!syn)
+		window >>= ctx->rcv_wscale;
+	return (uint16_t)MIN(window, (uint32_t)TCP_MAXWIN);
+}
+
+/* options carried on our SYN or SYN-ACK; returns their length, which is
+ * always a multiple of four bytes.
+ */
+static size_t write_syn_options(const context_t *ctx, uint8_t *options)
+{
+	size_t len = 0;
+
+	assert(ctx && options);
+
+	options[len++] = TCPOPT_MAXSEG;
+	options[len++] = 4;
+	options[len++] = (uint8_t)(ctx->mss >> 8);
+	options[len++] = (uint8_t)ctx->mss;
+
+	if (ctx->sack_permitted)
+	{
+		options[len++] = TCPOPT_NOP;
+		options[len++] = TCPOPT_NOP;
+		options[len++] = TCPOPT_SACK_PERMITTED;
+		options[len++] = 2;
+	}
+
+	if (ctx->wscale_ok)
+	{
+		options[len++] = TCPOPT_NOP;
+		options[len++] = TCPOPT_WSCALE;
+		options[len++] = 3;
+		options[len++] = ctx->rcv_wscale;
+	}
+
+	assert(len % sizeof(uint32_t) == 0 && len <= MAX_OPTIONS_LEN);
+	return len;
+}
+
+/* SACK blocks describing the out-of-order data we hold, the block with the
+ * most recent arrival first (RFC 2018, section 4); returns the option
+ * length, or zero if there is nothing to report.
+ */
+static size_t write_sack_option(const context_t *ctx, uint8_t *options)
+{
+	tcp_seq start[MAX_SACK_BLOCKS], end[MAX_SACK_BLOCKS];
+	int num_blocks = 0, k, n;
+	size_t len = 0;
+
+	assert(ctx && options);
+
+	if (!ctx->sack_permitted || ctx->num_ooo_intervals == 0)
+		return 0;
+
+	for (n = 0; n < ctx->num_ooo_intervals; ++n)
+	{
+		tcp_seq block_start = ctx->ooo_intervals[n].start;
+		tcp_seq block_end = ctx->ooo_intervals[n].end;
+		bool_t first;
+
+		first = SEQ_GEQ(ctx->last_ooo_seq, block_start) &&
+		        SEQ_LT(ctx->last_ooo_seq, block_end);
+
+		if (first)
+		{
+			/* move the most recently updated block to the front */
+			for (k = MIN(num_blocks, MAX_SACK_BLOCKS - 1); k > 0; --k)
 			{
-				handshake_err_handling(sd);
-				return;
+				start[k] = start[k - 1];
+				end[k] = end[k - 1];
 			}
+			start[0] = block_start;
+			end[0] = block_end;
+			num_blocks = MIN(num_blocks + 1, MAX_SACK_BLOCKS);
 		}
-		else {
-			handshake_err_handling(sd);
-			return;
+		else if (num_blocks < MAX_SACK_BLOCKS)
+		{
+			start[num_blocks] = block_start;
+			end[num_blocks] = block_end;
+			num_blocks++;
 		}
 	}
 
-	ctx->connection_state = CSTATE_ESTABLISHED;
-	
-	stcp_unblock_application(sd);
+	options[len++] = TCPOPT_NOP;
+	options[len++] = TCPOPT_NOP;
+	options[len++] = TCPOPT_SACK;
+	options[len++] = 2 + num_blocks * 2 * sizeof(tcp_seq);
 
-	control_loop(sd, ctx);
+	for (k = 0; k < num_blocks; ++k)
+	{
+		tcp_seq block[2];
 
-	/* do any cleanup here */
-	free(ctx);
-	free(header_packet);
-}
+		block[0] = htonl(start[k]);
+		block[1] = htonl(end[k]);
+		memcpy(options + len, block, sizeof(block));
+		len += sizeof(block);
+	}
 
+	assert(len % sizeof(uint32_t) == 0 && len <= MAX_OPTIONS_LEN);
+	return len;
+}
 
-/* generate random initial sequence number for an STCP connection */
-static void generate_initial_seq_num(context_t *ctx)
+/* pull the options we understand out of a segment's header; malformed
+ * options end the parse, leaving whatever was found up to that point.
+ */
+static void parse_options(const STCPHeader *header, tcp_options_t *options)
 {
-	assert(ctx);
+	const uint8_t *p = (const uint8_t *)(header + 1);
+	size_t len = TCP_OPTIONS_LEN(header);
+	size_t k = 0;
 
-#ifdef FIXED_INITNUM
-	/* please don't change this! */
-	ctx->initial_sequence_num = 1;
-#else
-	srand(*(unsigned int *)&ctx);
-	ctx->initial_sequence_num = rand() % (MAX_SEQ_NUM+1);
-#endif
+	assert(header && options);
+	memset(options, 0, sizeof(*options));
+
+	if (TCP_DATA_START(header) < sizeof(STCPHeader))
+		return;
+
+	while (k < len)
+	{
+		uint8_t kind = p[k], option_len;
+
+		if (kind == TCPOPT_EOL)
+			break;
+
+		if (kind == TCPOPT_NOP)
+		{
+			k++;
+			continue;
+		}
+
+		if (k + 1 >= len || (option_len = p[k + 1]) < 2 || k + option_len > len)
+			break;
+
+		if (kind == TCPOPT_MAXSEG && option_len == 4)
+		{
+			options->mss = (p[k + 2] << 8) | p[k + 3];
+		}
+		else if (kind == TCPOPT_SACK_PERMITTED && option_len == 2)
+		{
+			options->sack_permitted = TRUE;
+		}
+		else if (kind == TCPOPT_WSCALE && option_len == 3)
+		{
+			options->wscale_ok = TRUE;
+			options->wscale = p[k + 2];
+		}
+		else if (kind == TCPOPT_SACK && (option_len - 2) % 8 == 0)
+		{
+			int n;
+
+			for (n = 0; n < (option_len - 2) / 8 && n < MAX_SACK_BLOCKS; ++n)
+			{
+				tcp_seq block[2];
+
+				memcpy(block, p + k + 2 + n * sizeof(block), sizeof(block));
+				options->sack_start[n] = ntohl(block[0]);
+				options->sack_end[n] = ntohl(block[1]);
+			}
+			options->num_sack_blocks = n;
+		}
+
+		k += option_len;
+	}
 }
 
 
@@ -211,142 +1129,1857 @@ static void generate_initial_seq_num(context_t *ctx)
 *   - new data from the application (via mywrite())
 *   - the socket to be closed (via myclose())
 *   - a timeout
+* every event reported by a wakeup is dealt with before waiting again:
+* first all segments that have arrived, whose ACKs may free up room in
+* the send buffer, then the application's data and its close request.
 */
 static void control_loop(mysocket_t sd, context_t *ctx)
 {
 	assert(ctx);
 	assert(!ctx->done);
 
-	STCPHeader *header, *header_packet;	
-
 	while (!ctx->done)
 	{
-		header = (STCPHeader *)calloc(1, sizeof(STCPHeader));
-		
-		unsigned int event;
+		unsigned int event, wait_flags;
+		uint64_t wakeup;
+
+		/* only take more data from the app while the send buffer has room;
+		 * otherwise APP_DATA would stay signalled and we would spin.
+		 */
+		wait_flags = NETWORK_DATA | APP_CLOSE_REQUESTED | APP_OPTIONS_CHANGED;
+		if (!ctx->fin_pending &&
+		    ctx->send_buffer_end - ctx->sender_unack_seq < ctx->send_buffer_size)
+			wait_flags |= APP_DATA;
+
+		/* once less than half the target is on offer, the application
+		 * reading its data may let us open the window again
+		 */
+		if (SEQ_LT(ctx->rcv_adv - ctx->rcv_space_target / 2,
+		           ctx->receiver_next_seq))
+			wait_flags |= APP_DATA_CONSUMED;
+
+		/* wake up no later than the retransmission, persist or keepalive
+		 * timer expiry or the time a delayed ACK is due
+		 */
+		wakeup = ctx->rto_deadline;
+		if (ctx->persist_deadline && (!wakeup || ctx->persist_deadline < wakeup))
+			wakeup = ctx->persist_deadline;
+		if (ctx->keepalive_deadline &&
+		    (!wakeup || ctx->keepalive_deadline < wakeup))
+			wakeup = ctx->keepalive_deadline;
+		if (ctx->ack_deadline && (!wakeup || ctx->ack_deadline < wakeup))
+			wakeup = ctx->ack_deadline;
+		if (ctx->pacing_wait && (!wakeup || ctx->next_send_time < wakeup))
+			wakeup = ctx->next_send_time;
+		stcp_set_timer(sd, wakeup);
 
 		/* see stcp_api.h or stcp_api.c for details of this function */
-		/* XXX: you will need to change some of these arguments! */
-		event = stcp_wait_for_event(sd, ANY_EVENT, NULL);
-		
-		/* check whether it was the network, app, or a close request */
-		if (event & APP_DATA)
-		{
-			/* Make sure data is sent only if space is available */
-			if (ctx->sender_next_seq < ctx->sender_unack_seq + ctx->receiver_window_size)
-			{
-				char packet[STCP_MSS] = { 0 };
-				size_t packet_size = stcp_app_recv(sd, packet, STCP_MSS);
+		event = stcp_wait_for_event(sd, wait_flags, NULL);
 
-				ctx->sender_next_seq++;
-				header->th_seq = ctx->sender_next_seq;
-				header->th_win = WINDOW_SIZE;
+		if (event & NETWORK_DATA)
+		{
+			handle_network_segments(sd, ctx);
+		}
 
-				// Currently sending a new header plus the entire packet
-				stcp_network_send(sd, header, HEADER_SIZE, packet, packet_size, NULL);
+		if ((event & APP_DATA) && !ctx->done)
+		{
+			fill_send_buffer(sd, ctx);
+		}
 
-				clear_header(header);
-			}
+		if (event & APP_CLOSE_REQUESTED)
+		{
+			ctx->fin_pending = TRUE;
 		}
 
-		else if (event & NETWORK_DATA)
+		if (event & APP_OPTIONS_CHANGED)
 		{
-			uint8_t *header_data_packet = (uint8_t *)calloc(1, STCP_MSS);
-			uint8_t *data = (uint8_t*)(header_data_packet + sizeof(STCPHeader));
-			uint16_t packet_length = stcp_network_recv(sd, header_data_packet, STCP_MSS);
-			header_packet = (STCPHeader*)header_data_packet;
-			header_packet->th_off = 5;
-
-			if(header_packet->th_flags == TH_ACK){
-				
-				if(ctx->connection_state == CSTATE_FIN_WAIT_1)
-				{
-					ctx->connection_state = CSTATE_FIN_WAIT_2;					
-				}
-					
-				else if(ctx->connection_state == CSTATE_LAST_ACK)
-				{
-					ctx->connection_state = CSTATE_CLOSED;
-					ctx->done = true;
-				}
-					
-				ctx->sender_next_seq = ntohl(header_packet->th_ack);
-				ctx->receiver_next_seq = ntohl(header_packet->th_seq);
-				ctx->sender_unack_seq = ntohl(header_packet->th_ack);
-			}
-			else
+			int algorithm = stcp_get_option(sd, MYSO_CONGESTION);
+
+			/* a new module takes over from the current window */
+			if (algorithm != ctx->cc_algorithm)
 			{
-				//send data to app
-					ctx->sender_next_seq = ntohl(header_packet->th_ack);
-					ctx->receiver_next_seq = ntohl(header_packet->th_seq) + 1;
-					ctx->sender_unack_seq = ntohl(header_packet->th_ack);
-					stcp_app_send(sd, data, packet_length - TCP_DATA_START(header_packet));
-				
-			
-				if(header_packet->th_flags == TH_FIN){				
-					if (ctx->connection_state == CSTATE_ESTABLISHED)
-						ctx->connection_state = CSTATE_CLOSE_WAIT;
-
-					else if (ctx->connection_state == CSTATE_FIN_WAIT_1)
-						ctx->connection_state = CSTATE_CLOSING;
-
-					else if (ctx->connection_state == CSTATE_FIN_WAIT_2)
-					{
-						ctx->connection_state = CSTATE_CLOSED;
-						ctx->done = true;
-					}
-					
-					ctx->sender_next_seq = ntohl(header_packet->th_ack);
-					ctx->receiver_next_seq = ntohl(header_packet->th_seq) + 1;
-					ctx->sender_unack_seq = ntohl(header_packet->th_ack);
-					
-					header_packet->th_seq = htonl(ctx->sender_next_seq);
-					header_packet->th_ack = htonl(ctx->receiver_next_seq);
-					header_packet->th_flags = TH_ACK;
-					header_packet->th_win = htons(ctx->receiver_window_size);
-
-					stcp_network_send(sd, header_packet, sizeof(STCPHeader), NULL);
-					stcp_fin_received(sd);
-
-				}
-				else 
-				{  // send out ack
-					header_packet->th_seq = htonl(ctx->sender_next_seq);
-					header_packet->th_ack = htonl(ctx->receiver_next_seq);
-					header_packet->th_flags = TH_ACK;
-					header_packet->th_win = htons(ctx->receiver_window_size);
-
-					stcp_network_send(sd, header_packet, sizeof(STCPHeader), NULL);
-				}	
+				ctx->cc_algorithm = algorithm;
+				congestion_init(&ctx->cc, congestion_lookup(algorithm));
 			}
-			free(header_data_packet);
+
+			read_socket_options(sd, ctx);
 		}
 
-		else if (event & APP_CLOSE_REQUESTED)
+		if (event & APP_DATA_CONSUMED)
 		{
-			if (ctx->connection_state == CSTATE_ESTABLISHED)
-				ctx->connection_state = CSTATE_FIN_WAIT_1;
+			receive_window_opened(sd, ctx);
+		}
+
+		if (!ctx->done && ctx->rto_deadline &&
+		    stcp_current_time() >= ctx->rto_deadline)
+			retransmit_timeout(sd, ctx);
 
-			else if (ctx->connection_state == CSTATE_CLOSE_WAIT)
-				ctx->connection_state = CSTATE_LAST_ACK;
+		if (!ctx->done && ctx->persist_deadline &&
+		    stcp_current_time() >= ctx->persist_deadline)
+			persist_timeout(sd, ctx);
 
-			header_packet->th_seq = htonl(ctx->sender_next_seq);
-			header_packet->th_ack = htonl(ctx->receiver_next_seq);
-			header_packet->th_flags = TH_FIN;
-			header_packet->th_win = htons(ctx->receiver_window_size);
-			stcp_network_send(sd, header_packet, sizeof(STCPHeader), NULL);
+		if (!ctx->done && ctx->keepalive_deadline &&
+		    stcp_current_time() >= ctx->keepalive_deadline)
+			keepalive_timeout(sd, ctx);
+
+		if (!ctx->done)
+		{
+			send_pending_data(sd, ctx);
+			update_persist_timer(ctx);
+			update_keepalive_timer(ctx);
 		}
 
-		free(header);
+		/* an ACK still owed after any data went out is sent on its own.
+		 * this holds even once we are done, so that the peer's FIN is
+		 * acknowledged.
+		 */
+		if (ctx->ack_now ||
+		    (ctx->ack_deadline && stcp_current_time() >= ctx->ack_deadline))
+			send_segment(sd, ctx, ctx->sender_next_seq, TH_ACK, 0);
 	}
 }
 
-void clear_header(tcphdr *header)
+/* take data from the application into the send buffer.  with MYSO_AUTOCORK
+ * set, everything the application has queued (as far as it fits) is taken
+ * at once, so that a burst of small mywrite() calls is segmented together
+ * rather than one write per segment.
+ */
+static void fill_send_buffer(mysocket_t sd, context_t *ctx)
 {
-	header->th_flags = 0;
-	header->th_ack = 0;
-	header->th_seq = 0;
-	header->th_win = 0;
+	size_t free_space, start, contiguous, len;
+
+	assert(ctx);
+
+	do
+	{
+		free_space = ctx->send_buffer_size -
+		             (ctx->send_buffer_end - ctx->sender_unack_seq);
+		start = SEND_BUFFER_INDEX(ctx, ctx->send_buffer_end);
+		contiguous = MIN(free_space, ctx->send_buffer_size - start);
+		assert(contiguous > 0);
+
+		len = stcp_app_recv(sd, ctx->send_buffer + start, contiguous);
+		ctx->send_buffer_end += len;
+	} while (ctx->autocork && len > 0 &&
+	         ctx->send_buffer_end - ctx->sender_unack_seq < ctx->send_buffer_size &&
+	         app_data_queued(sd));
+}
+
+/* the congestion window has room for another len bytes.  one segment may
+ * always be outstanding, so a window below a full segment can't stall us,
+ * and an outstanding path MTU probe counts as a single segment, as it
+ * would in a window counted in packets.
+ */
+#define CWND_ALLOWS(ctx, len) \
+	(bytes_in_flight(ctx) == 0 || \
+	 bytes_in_flight(ctx) + (len) <= (ctx)->cc.cwnd + PROBE_EXCESS(ctx))
+
+#define PROBE_EXCESS(ctx) \
+	((ctx)->probe_size ? (ctx)->probe_size - (ctx)->mss : 0)
+
+/* TRUE if the application has data waiting to be taken by stcp_app_recv()
+ * (which would otherwise block)
+ */
+static bool_t app_data_queued(mysocket_t sd)
+{
+	struct timespec now = { 0, 0 };
+
+	return (stcp_wait_for_event(sd, APP_DATA, &now) & APP_DATA) != 0;
+}
+
+/* first resend any segments presumed lost, then transmit MSS-sized segments
+ * of new data (now and then a larger path MTU probe) for as long as both
+ * the peer's advertised window and the congestion window allow, followed
+ * by our FIN once the app has closed and every buffered byte has gone out.
+ */
+static void send_pending_data(mysocket_t sd, context_t *ctx)
+{
+	segment_t *segment;
+
+	assert(ctx);
+
+	ctx->pacing_wait = FALSE;
+
+	for (segment = ctx->retransmit_head; segment && ctx->lost_bytes > 0;
+	     segment = segment->next)
+	{
+		if (!segment->lost)
+			continue;
+
+		/* a lost probe goes again in segments the path is known to carry */
+		if (segment->data_len > ctx->mss)
+			split_segment(ctx, segment);
+
+		if (!CWND_ALLOWS(ctx, segment->data_len) || !pacing_allows(ctx))
+			return;
+
+		retransmit_segment(sd, ctx, segment);
+		pacing_update(ctx, segment->data_len);
+	}
+
+	while (SEQ_LT(ctx->sender_next_seq, ctx->send_buffer_end))
+	{
+		uint32_t in_flight = ctx->sender_next_seq - ctx->sender_unack_seq;
+		size_t len;
+
+		if (in_flight >= ctx->sender_window_size)
+			break;
+
+		if ((len = next_probe_size(ctx, in_flight)) == 0)
+		{
+			len = MIN((size_t)(ctx->send_buffer_end - ctx->sender_next_seq),
+			          (size_t)ctx->mss);
+			len = MIN(len, (size_t)(ctx->sender_window_size - in_flight));
+		}
+
+		if (!CWND_ALLOWS(ctx, len))
+			break;
+
+		if (len < ctx->mss && hold_partial_segment(ctx))
+			break;
+
+		if (!pacing_allows(ctx))
+			break;
+
+		send_new_segment(sd, ctx, ctx->sender_next_seq, TH_ACK, len);
+		pacing_update(ctx, len);
+		ctx->sender_next_seq += len;
+
+		if (len > ctx->mss)
+		{
+			dprintf("path MTU probe of %u bytes\n", (unsigned)len);
+			ctx->retransmit_tail->probe = TRUE;
+			ctx->probe_size = len;
+		}
+
+		if (len < ctx->mss)
+			ctx->small_seg_end = ctx->sender_next_seq;
+	}
+
+	/* everything the application gave us is out, with room to spare:
+	 * rate samples up to here show the application's rate, not the
+	 * network's
+	 */
+	if (ctx->sender_next_seq == ctx->send_buffer_end && ctx->lost_bytes == 0 &&
+	    bytes_in_flight(ctx) < ctx->cc.cwnd)
+		ctx->app_limited = MAX(ctx->delivered + bytes_in_flight(ctx), 1);
+
+	if (ctx->fin_pending && !ctx->fin_sent &&
+	    ctx->sender_next_seq == ctx->send_buffer_end)
+	{
+		ctx->fin_seq = ctx->sender_next_seq;
+		send_new_segment(sd, ctx, ctx->fin_seq, TH_FIN | TH_ACK, 0);
+		ctx->sender_next_seq++;
+		ctx->fin_sent = TRUE;
+		change_state(ctx, CEVENT_CLOSE);
+	}
+}
+
+/* whether a segment shorter than the MSS should wait for more data.  it
+ * does while the application has the socket corked (MYSO_CORK), and under
+ * Nagle's algorithm (RFC 896, unless MYSO_NODELAY is set) while an earlier
+ * short segment is unacknowledged.  (that is Minshall's variant: a short
+ * segment behind full-sized ones goes out at once, instead of waiting for
+ * a delayed ACK at the end of every write.)  once the application has
+ * closed, nothing more is coming, so the tail of the stream always goes
+ * out.
+ */
+static bool_t hold_partial_segment(const context_t *ctx)
+{
+	assert(ctx);
+
+	if (ctx->fin_pending)
+		return FALSE;
+
+	if (ctx->cork)
+		return TRUE;
+
+	return !ctx->nodelay &&
+	       SEQ_GT(ctx->small_seg_end, ctx->sender_unack_seq);
+}
+
+/* whether the congestion control module's pacing rate lets the next data
+ * segment go out now.  if not, pacing_wait makes control_loop() wake up when
+ * it may.
+ */
+static bool_t pacing_allows(context_t *ctx)
+{
+	assert(ctx);
+
+	if (!ctx->cc.pacing_rate || stcp_current_time() >= ctx->next_send_time)
+		return TRUE;
+
+	ctx->pacing_wait = TRUE;
+	return FALSE;
+}
+
+/* space the next data segment after one of len bytes just sent */
+static void pacing_update(context_t *ctx, size_t len)
+{
+	uint64_t now;
+
+	assert(ctx);
+
+	if (!ctx->cc.pacing_rate)
+		return;
+
+	now = stcp_current_time();
+	ctx->next_send_time = MAX(now, ctx->next_send_time) +
+	                      (uint64_t)len * 1000000 / ctx->cc.pacing_rate;
+}
+
+/* send a single segment starting at seq, carrying data_len bytes from the
+ * send buffer (which may wrap around the end of the ring).
+ */
+static void send_segment(mysocket_t sd, context_t *ctx, tcp_seq seq,
+                         uint8_t flags, size_t data_len)
+{
+	uint8_t header_buf[HEADER_SIZE + MAX_OPTIONS_LEN];
+	STCPHeader *header = (STCPHeader *)header_buf;
+	size_t header_len, start, first_len;
+	tcp_seq right_edge;
+
+	assert(ctx);
+	assert(data_len <= ctx->mss_ceiling);
+
+	memset(header, 0, sizeof(STCPHeader));
+	header->th_seq = htonl(seq);
+	header->th_ack = htonl(ctx->receiver_next_seq);
+	header->th_flags = flags;
+	update_receive_window(sd, ctx);
+	header->th_win = htons(advertised_window(ctx, FALSE));
+
+	right_edge = ctx->receiver_next_seq +
+	             ((uint32_t)ntohs(header->th_win) << ctx->rcv_wscale);
+	if (SEQ_GT(right_edge, ctx->rcv_adv))
+		ctx->rcv_adv = right_edge;
+
+	header_len = sizeof(STCPHeader);
+	if (flags & TH_ACK)
+	{
+		header_len += write_sack_option(ctx, header_buf + header_len);
+
+		/* this acknowledges everything received so far */
+		ctx->ack_pending_bytes = 0;
+		ctx->ack_deadline = 0;
+		ctx->ack_now = FALSE;
+	}
+	header->th_off = header_len / sizeof(uint32_t);
+
+	start = SEND_BUFFER_INDEX(ctx, seq);
+	first_len = MIN(data_len, (size_t)(ctx->send_buffer_size - start));
+
+	if (data_len == 0)
+		stcp_network_send(sd, header_buf, header_len, NULL);
+	else if (first_len == data_len)
+		stcp_network_send(sd, header_buf, header_len,
+		                  ctx->send_buffer + start, data_len, NULL);
+	else
+		stcp_network_send(sd, header_buf, header_len,
+		                  ctx->send_buffer + start, first_len,
+		                  ctx->send_buffer, data_len - first_len, NULL);
+}
+
+/* send a segment for the first time, remembering it for retransmission and
+ * starting the retransmission timer if it isn't already running.
+ */
+static void send_new_segment(mysocket_t sd, context_t *ctx, tcp_seq seq,
+                             uint8_t flags, size_t data_len)
+{
+	segment_t *segment;
+
+	assert(ctx);
+
+	segment = alloc_segment(ctx);
+	memset(segment, 0, sizeof(segment_t));
+
+	segment->seq = seq;
+	segment->data_len = data_len;
+	segment->flags = flags & TH_FIN;
+	segment->sent_time = stcp_current_time();
+	segment->transmissions = 1;
+	rate_on_send(ctx, segment, segment->sent_time);
+
+	if (ctx->retransmit_tail)
+		ctx->retransmit_tail->next = segment;
+	else
+		ctx->retransmit_head = segment;
+	ctx->retransmit_tail = segment;
+
+	send_segment(sd, ctx, seq, flags, data_len);
+
+	if (ctx->in_recovery)
+		ctx->prr_out += data_len;
+
+	if (!ctx->rto_deadline)
+		ctx->rto_deadline = segment->sent_time + ctx->rto;
+}
+
+/* resend a segment from the retransmission queue */
+static void retransmit_segment(mysocket_t sd, context_t *ctx,
+                               segment_t *segment)
+{
+	assert(ctx && segment);
+
+	dprintf("retransmitting seq %u (%u bytes)\n",
+	        segment->seq, (unsigned)segment->data_len);
+
+	send_segment(sd, ctx, segment->seq, TH_ACK | segment->flags,
+	             segment->data_len);
+	segment->sent_time = stcp_current_time();
+	segment->transmissions++;
+	rate_on_send(ctx, segment, segment->sent_time);
+
+	if (segment->lost)
+	{
+		segment->lost = FALSE;
+		ctx->lost_bytes -= SEGMENT_SEQ_LEN(segment);
+	}
+
+	if (ctx->in_recovery)
+		ctx->prr_out += segment->data_len;
+
+	if (!ctx->rto_deadline)
+		ctx->rto_deadline = segment->sent_time + ctx->rto;
+}
+
+/* cut a segment down to the MSS, queueing the remainder right behind it as
+ * a segment of its own in the same state
+ */
+static void split_segment(context_t *ctx, segment_t *segment)
+{
+	segment_t *rest;
+
+	assert(ctx && segment && segment->data_len > ctx->mss);
+
+	rest = alloc_segment(ctx);
+	*rest = *segment;
+	rest->seq = segment->seq + ctx->mss;
+	rest->data_len = segment->data_len - ctx->mss;
+	segment->data_len = ctx->mss;
+	segment->flags &= (uint8_t)~TH_FIN;
+	segment->next = rest;
+
+	if (ctx->retransmit_tail == segment)
+		ctx->retransmit_tail = rest;
+}
+
+/* the size of the path MTU probe to send next, or zero if it isn't time
+ * for one.  probes go out one at a time, never while losses are being
+ * repaired, and only when there is data to fill one and enough ordinary
+ * segments to follow it that its loss shows up as duplicate ACKs rather
+ * than as a timeout; the peer's window must have room for all of them.
+ * against the congestion window a probe counts as a single segment.  the
+ * first probe of a search tries the ceiling itself, since most paths carry
+ * it; after that the search splits the remaining range in half.
+ */
+static uint32_t next_probe_size(context_t *ctx, uint32_t in_flight)
+{
+	uint32_t size, needed;
+
+	assert(ctx);
+
+	if (ctx->probe_size || ctx->in_recovery || ctx->lost_bytes)
+		return 0;
+
+	if (ctx->mtu_search_high - ctx->mtu_search_low < PLPMTUD_MIN_RANGE)
+	{
+		if (ctx->mtu_search_low >= ctx->mss_ceiling ||
+		    stcp_current_time() < ctx->probe_timer)
+			return 0;
+
+		/* see whether the path carries more now */
+		ctx->mtu_search_high = ctx->mss_ceiling;
+		ctx->probe_failures = 0;
+	}
+
+	if (ctx->mtu_search_high == ctx->mss_ceiling)
+		size = ctx->mtu_search_high;
+	else
+		size = (ctx->mtu_search_low + ctx->mtu_search_high + 1) / 2;
+
+	needed = size + DUPACK_THRESHOLD * ctx->mss;
+	if ((uint32_t)(ctx->send_buffer_end - ctx->sender_next_seq) < needed ||
+	    in_flight + needed > ctx->sender_window_size ||
+	    !CWND_ALLOWS(ctx, ctx->mss))
+		return 0;
+
+	return size;
+}
+
+/* the outstanding probe got through: segments that large are safe.  the
+ * congestion window keeps its size in segments, as a window counted in
+ * packets would.
+ */
+static void mtu_probe_succeeded(context_t *ctx)
+{
+	assert(ctx && ctx->probe_size);
+
+	dprintf("path MTU probe of %u bytes succeeded\n", ctx->probe_size);
+
+	ctx->cc.cwnd = rescale_window(ctx->cc.cwnd, ctx->mss, ctx->probe_size);
+	if (ctx->cc.ssthresh != ~(uint32_t)0)
+		ctx->cc.ssthresh = rescale_window(ctx->cc.ssthresh, ctx->mss,
+		                                  ctx->probe_size);
+
+	ctx->mtu_search_low = ctx->probe_size;
+	ctx->mss = ctx->probe_size;
+	ctx->cc.mss = ctx->mss;
+	ctx->probe_size = 0;
+	ctx->probe_failures = 0;
+
+	if (ctx->mtu_search_high - ctx->mtu_search_low < PLPMTUD_MIN_RANGE)
+		ctx->probe_timer = stcp_current_time() + PLPMTUD_INTERVAL;
+}
+
+/* a window of bytes counted in segments of old_mss, in segments of new_mss.
+ * the result stays short of ~0, which stands for no ssthresh at all.
+ */
+static uint32_t rescale_window(uint32_t window, uint32_t old_mss,
+                               uint32_t new_mss)
+{
+	uint64_t scaled = (uint64_t)window * new_mss / old_mss;
+
+	return (uint32_t)MIN(scaled, (uint64_t)~(uint32_t)0 - 1);
+}
+
+/* the outstanding probe was lost.  one loss says little, but after
+ * PLPMTUD_MAX_PROBES of them the search looks below that size.  the data
+ * itself is resent in MSS-sized pieces.
+ */
+static void mtu_probe_failed(context_t *ctx, segment_t *segment)
+{
+	assert(ctx && segment && segment->probe && ctx->probe_size);
+
+	dprintf("path MTU probe of %u bytes lost\n", ctx->probe_size);
+
+	segment->probe = FALSE;
+	if (++ctx->probe_failures >= PLPMTUD_MAX_PROBES)
+	{
+		ctx->mtu_search_high = ctx->probe_size - 1;
+		ctx->probe_failures = 0;
+		ctx->probe_timer = stcp_current_time() + PLPMTUD_INTERVAL;
+	}
+	ctx->probe_size = 0;
+}
+
+/* receive and act on every segment that has arrived since the last
+ * wakeup, as one batch
+ */
+static void handle_network_segments(mysocket_t sd, context_t *ctx)
+{
+	size_t count;
+
+	assert(ctx);
+
+	for (count = stcp_network_recv_batch(sd); count > 0 && !ctx->done; --count)
+		handle_network_segment(sd, ctx);
+}
+
+/* read one segment from the peer and act on it */
+static void handle_network_segment(mysocket_t sd, context_t *ctx)
+{
+	ssize_t segment_len;
+
+	assert(ctx);
+
+	segment_len = stcp_network_recv(sd, ctx->segment_buf, ctx->max_packet_len);
+	if (segment_len <= 0)
+	{
+		/* the network layer lost its connection to the peer */
+		errno = ECONNRESET;
+		ctx->done = TRUE;
+		return;
+	}
+
+	process_segment(sd, ctx, segment_len);
+}
+
+/* act on the segment of segment_len bytes in segment_buf */
+static void process_segment(mysocket_t sd, context_t *ctx, size_t segment_len)
+{
+	uint8_t *segment = ctx->segment_buf;
+	STCPHeader *header = (STCPHeader *)segment;
+	size_t data_len;
+	tcp_seq seq;
+	bool_t fin, beyond_window, immediate;
+	uint64_t now;
+
+	assert(ctx);
+
+	if (segment_len < sizeof(STCPHeader) ||
+	    TCP_DATA_START(header) < sizeof(STCPHeader) ||
+	    TCP_DATA_START(header) > segment_len ||
+	    segment_len > ctx->max_packet_len)
+		return;
+
+	/* whatever it is, the peer is still there */
+	now = stcp_current_time();
+	ctx->last_heard = now;
+	ctx->keepalive_probes = 0;
+
+	/* a SYN now is a duplicate: the peer resent its SYN-ACK because our
+	 * ACK went missing, or resent its SYN before our SYN-ACK reached it.
+	 * acknowledging it again lets the peer finish its handshake.
+	 */
+	if (header->th_flags & TH_SYN)
+	{
+		ctx->ack_now = TRUE;
+		return;
+	}
+
+	data_len = segment_len - TCP_DATA_START(header);
+	if (header_prediction(sd, ctx, header, data_len, now))
+		return;
+
+	seq = ntohl(header->th_seq);
+
+	if (header->th_flags & TH_ACK)
+		process_ack(ctx, header, data_len, now);
+
+	/* an empty segment from before the window is the peer's keepalive
+	 * probe (or an old duplicate); either way it is answered with an ACK
+	 * (RFC 793)
+	 */
+	if (!ctx->done && data_len == 0 && !(header->th_flags & TH_FIN) &&
+	    SEQ_LT(seq, ctx->receiver_next_seq))
+		ctx->ack_now = TRUE;
+
+	if (ctx->done || (data_len == 0 && !(header->th_flags & TH_FIN)))
+		return;
+
+	fin = (header->th_flags & TH_FIN) != 0;
+
+	/* data beyond the window we offered--a window probe, or a peer
+	 * overrunning the window--is not taken, and neither is a FIN after
+	 * it.  only what fits is accepted (nothing, if the window is closed),
+	 * and the ACK, sent at once, tells the peer to send the rest again
+	 * when the window opens.
+	 */
+	beyond_window = SEQ_GT(seq + data_len, ctx->rcv_adv);
+	if (beyond_window)
+	{
+		data_len = SEQ_GT(ctx->rcv_adv, seq) ? ctx->rcv_adv - seq : 0;
+		fin = FALSE;
+	}
+
+	if (beyond_window && SEQ_GEQ(seq, ctx->rcv_adv))
+	{
+		/* none of it lies inside the window, so there is nothing to take;
+		 * only the ACK goes out
+		 */
+		schedule_ack(ctx, 0, TRUE);
+		return;
+	}
+
+	/* in-order data may have its ACK delayed.  anything else--data beyond
+	 * a hole, data filling one, duplicates and FINs--is acknowledged at
+	 * once, so the peer's loss recovery sees it without delay; while
+	 * out-of-order data is held the ACK carries SACK blocks.  so is a
+	 * segment larger than any before, most likely a path MTU probe the
+	 * peer is waiting to hear about.
+	 */
+	immediate = seq != ctx->receiver_next_seq ||
+	            ctx->num_ooo_intervals > 0 ||
+	            fin || beyond_window ||
+	            data_len > ctx->rcv_mss;
+	ctx->rcv_mss = MAX(ctx->rcv_mss, (uint32_t)data_len);
+
+	receive_data(sd, ctx, seq, segment + TCP_DATA_START(header), data_len,
+	             fin);
+	rcv_rtt_measure(ctx, now);
+
+	schedule_ack(ctx, data_len, immediate || ctx->num_ooo_intervals > 0);
+}
+
+/* header prediction (Van Jacobson).  in bulk transfer almost every segment
+ * in the established state is either the next in-order data, acknowledging
+ * nothing new with the window unchanged, or a pure ACK for new data outside
+ * loss recovery, and carries no options.  those two are dealt with here, in
+ * a few tests, instead of by the general path; anything else returns FALSE
+ * untouched.
+ */
+static bool_t header_prediction(mysocket_t sd, context_t *ctx,
+                                const STCPHeader *header, size_t data_len,
+                                uint64_t now)
+{
+	tcp_seq seq = ntohl(header->th_seq);
+	tcp_seq ack = ntohl(header->th_ack);
+	uint32_t window = (uint32_t)ntohs(header->th_win) << ctx->snd_wscale;
+
+	assert(ctx && header);
+
+	if (ctx->connection_state != CSTATE_ESTABLISHED ||
+	    header->th_flags != TH_ACK ||
+	    TCP_DATA_START(header) != sizeof(STCPHeader) ||
+	    seq != ctx->receiver_next_seq)
+		return FALSE;
+
+	if (data_len == 0)
+	{
+		rate_sample_t rs;
+		congestion_ack_t sample;
+
+		/* a pure ACK for new data, with no scoreboard to update.  the
+		 * receiver's window moves with nearly every one, and is simply
+		 * taken as it is, as the general path would.
+		 */
+		if (!SEQ_GT(ack, ctx->sender_unack_seq) ||
+		    SEQ_GT(ack, ctx->sender_next_seq) ||
+		    ctx->in_recovery || ctx->sacked_bytes || ctx->lost_bytes)
+			return FALSE;
+
+		memset(&rs, 0, sizeof(rs));
+		memset(&sample, 0, sizeof(sample));
+		sample.now = now;
+		sample.in_flight = bytes_in_flight(ctx);
+		sample.ack_seq = ack;
+		sample.acked = ack - ctx->sender_unack_seq;
+
+		ctx->persist_probes = 0;
+		ctx->dupacks = 0;
+		ctx->sender_unack_seq = ack;
+		ctx->sender_window_size = window;
+		sample.rtt = ack_advanced(ctx, remove_acked_segments(ctx, ack, &rs,
+		                                                     now), now);
+		congestion_on_ack(ctx, &sample, &rs);
+		return TRUE;
+	}
+
+	/* the next data in sequence, fitting the window and no larger than
+	 * what came before, with nothing held out of order and no FIN to
+	 * deliver after it
+	 */
+	if (ack != ctx->sender_unack_seq || window != ctx->sender_window_size ||
+	    ctx->num_ooo_intervals > 0 || ctx->peer_fin_seen ||
+	    data_len > ctx->rcv_mss ||
+	    SEQ_GT(seq + data_len, ctx->rcv_adv))
+		return FALSE;
+
+	ctx->persist_probes = 0;
+	stcp_app_send(sd, (const uint8_t *)header + sizeof(STCPHeader), data_len);
+	ctx->receiver_next_seq += data_len;
+	rcv_rtt_measure(ctx, now);
+	schedule_ack(ctx, data_len, FALSE);
+	return TRUE;
+}
+
+/* note that the data just received needs acknowledging.  the ACK is sent
+ * at the end of this wakeup if it is urgent, if ACK_EVERY_BYTES are now
+ * unacknowledged or if the socket's MYSO_ACK_DELAY is zero; otherwise the
+ * delayed ACK timer is started, if it is not already running.
+ */
+static void schedule_ack(context_t *ctx, size_t data_len, bool_t immediate)
+{
+	assert(ctx);
+
+	ctx->ack_pending_bytes += data_len;
+
+	if (immediate || !ctx->ack_delay || ctx->ack_pending_bytes >= ACK_EVERY_BYTES(ctx))
+		ctx->ack_now = TRUE;
+	else if (!ctx->ack_deadline)
+		ctx->ack_deadline = stcp_current_time() + ctx->ack_delay;
+}
+
+/* pass in-sequence data up to the application.  data beyond a hole is held
+ * in the reassembly buffer, and once the hole is filled the whole
+ * contiguous run goes up together.  the peer's FIN is acted on when
+ * everything before it has been delivered.  the caller has already cut
+ * the data at the right edge of the window we offered, as the
+ * application's buffer only has room for the window.
+ */
+static void receive_data(mysocket_t sd, context_t *ctx, tcp_seq seq,
+                         const uint8_t *data, size_t data_len, bool_t fin)
+{
+	assert(ctx);
+	assert(SEQ_LEQ(seq + data_len, ctx->rcv_adv));
+
+	if (fin && !ctx->peer_fin_seen && SEQ_GEQ(seq + data_len, ctx->receiver_next_seq))
+	{
+		ctx->peer_fin_seen = TRUE;
+		ctx->peer_fin_seq = seq + data_len;
+	}
+
+	if (SEQ_LEQ(seq, ctx->receiver_next_seq) &&
+	    SEQ_GT(seq + data_len, ctx->receiver_next_seq))
+	{
+		/* data at receiver_next_seq goes straight up without a copy, as far
+		 * as the first held run.  it must never depend on room in the
+		 * interval set, or a full set would stall the connection.
+		 */
+		size_t skip = ctx->receiver_next_seq - seq;
+		size_t len = data_len - skip;
+
+		if (ctx->num_ooo_intervals > 0)
+			len = MIN(len, (size_t)(ctx->ooo_intervals[0].start -
+			                        ctx->receiver_next_seq));
+
+		stcp_app_send(sd, data + skip, len);
+		ctx->receiver_next_seq += len;
+
+		seq += skip + len;
+		data += skip + len;
+		data_len -= skip + len;
+	}
+
+	/* anything left either lies beyond a hole or touches the first held
+	 * run and is merged with it.  that run goes up as soon as it starts at
+	 * receiver_next_seq, even if the data just delivered only filled the
+	 * hole before it.
+	 */
+	if (data_len > 0)
+		hold_out_of_order(ctx, seq, data, data_len);
+	deliver_held_data(sd, ctx);
+
+	if (ctx->peer_fin_seen && ctx->receiver_next_seq == ctx->peer_fin_seq)
+		process_fin(sd, ctx);
+}
+
+/* add data to the reassembly buffer.  it is trimmed to the part between
+ * receiver_next_seq and the right edge of our window, only bytes not
+ * already held are copied, and the interval set is updated, merging runs
+ * that now overlap or touch.  if the set is full the data is dropped; the
+ * sender will retransmit it.
+ */
+static void hold_out_of_order(context_t *ctx, tcp_seq seq,
+                              const uint8_t *data, size_t data_len)
+{
+	seq_interval_t *intervals = ctx->ooo_intervals;
+	tcp_seq window_end = ctx->receiver_next_seq + ctx->receiver_window_size;
+	tcp_seq end, pos;
+	int first, last, k;
+
+	assert(ctx && data);
+
+	if (SEQ_LT(seq, ctx->receiver_next_seq))
+	{
+		size_t skip = ctx->receiver_next_seq - seq;
+
+		if (skip >= data_len)
+			return;     /* a duplicate of data already delivered */
+
+		seq += skip;
+		data += skip;
+		data_len -= skip;
+	}
+
+	end = seq + data_len;
+	if (SEQ_GT(end, window_end))
+		end = window_end;
+	if (SEQ_LEQ(end, seq))
+		return;
+
+	/* intervals [first, last) overlap or touch the new run */
+	for (first = 0; first < ctx->num_ooo_intervals &&
+	     SEQ_LT(intervals[first].end, seq); ++first)
+		;
+	for (last = first; last < ctx->num_ooo_intervals &&
+	     SEQ_LEQ(intervals[last].start, end); ++last)
+		;
+
+	if (first == last && ctx->num_ooo_intervals == MAX_OOO_INTERVALS)
+		return;
+
+	/* copy only the gaps between runs we already hold */
+	for (pos = seq, k = first; k < last && SEQ_LT(pos, end); ++k)
+	{
+		if (SEQ_LT(pos, intervals[k].start))
+			copy_to_recv_buffer(ctx, pos, data + (pos - seq),
+			                    intervals[k].start - pos);
+		if (SEQ_GT(intervals[k].end, pos))
+			pos = intervals[k].end;
+	}
+	if (SEQ_LT(pos, end))
+		copy_to_recv_buffer(ctx, pos, data + (pos - seq), end - pos);
+
+	if (first == last)
+	{
+		/* a new, separate run */
+		memmove(intervals + first + 1, intervals + first,
+		        (ctx->num_ooo_intervals - first) * sizeof(*intervals));
+		intervals[first].start = seq;
+		intervals[first].end = end;
+		ctx->num_ooo_intervals++;
+	}
+	else
+	{
+		/* collapse the runs it touches into one */
+		if (SEQ_LT(seq, intervals[first].start))
+			intervals[first].start = seq;
+		if (SEQ_GT(intervals[last - 1].end, end))
+			end = intervals[last - 1].end;
+		intervals[first].end = end;
+
+		memmove(intervals + first + 1, intervals + last,
+		        (ctx->num_ooo_intervals - last) * sizeof(*intervals));
+		ctx->num_ooo_intervals -= last - first - 1;
+	}
+
+	ctx->last_ooo_seq = seq;
+}
+
+static void copy_to_recv_buffer(context_t *ctx, tcp_seq seq,
+                                const uint8_t *data, size_t len)
+{
+	size_t start = RECV_BUFFER_INDEX(ctx, seq);
+	size_t first_len = MIN(len, (size_t)(ctx->recv_buffer_size - start));
+
+	assert(ctx && data);
+	assert(len <= ctx->recv_buffer_size);
+
+	memcpy(ctx->recv_buffer + start, data, first_len);
+	memcpy(ctx->recv_buffer, data + first_len, len - first_len);
+}
+
+/* if the first held run now starts at receiver_next_seq, hand all of it to
+ * the application at once (in two pieces only if it wraps the ring).
+ */
+static void deliver_held_data(mysocket_t sd, context_t *ctx)
+{
+	seq_interval_t *run = &ctx->ooo_intervals[0];
+	size_t len, start, first_len;
+
+	assert(ctx);
+
+	if (ctx->num_ooo_intervals == 0 || run->start != ctx->receiver_next_seq)
+		return;
+
+	len = run->end - run->start;
+	start = RECV_BUFFER_INDEX(ctx, run->start);
+	first_len = MIN(len, (size_t)(ctx->recv_buffer_size - start));
+
+	stcp_app_send(sd, ctx->recv_buffer + start, first_len);
+	if (len > first_len)
+		stcp_app_send(sd, ctx->recv_buffer, len - first_len);
+
+	ctx->receiver_next_seq = run->end;
+
+	memmove(ctx->ooo_intervals, ctx->ooo_intervals + 1,
+	        (ctx->num_ooo_intervals - 1) * sizeof(seq_interval_t));
+	ctx->num_ooo_intervals--;
+}
+
+/* work out the window to offer: the target less what the application has
+ * yet to read, in the units th_win can carry.  unless the right edge moves
+ * by at least a segment (or half the target, if smaller), the window
+ * offered last time stands (RFC 1122, section 4.2.3.3), rounded up so
+ * that scaling doesn't pull the edge back.
+ */
+static void update_receive_window(mysocket_t sd, context_t *ctx)
+{
+	uint32_t unread, window, offered, unit;
+
+	assert(ctx);
+
+	unread = (uint32_t)stcp_app_unread(sd);
+	rcv_space_adjust(ctx, unread);
+
+	unit = (uint32_t)1 << ctx->rcv_wscale;
+	window = (ctx->rcv_space_target > unread) ?
+	         ctx->rcv_space_target - unread : 0;
+	window &= ~(unit - 1);
+
+	offered = SEQ_GT(ctx->rcv_adv, ctx->receiver_next_seq) ?
+	          ctx->rcv_adv - ctx->receiver_next_seq : 0;
+	if (window < offered + MIN(ctx->rcv_space_target / 2, ctx->rcv_mss))
+		window = MIN((offered + unit - 1) & ~(unit - 1),
+		             ctx->recv_buffer_size);
+
+	ctx->receiver_window_size = window;
+}
+
+/* the application has read some of its data.  if that opens the window by
+ * two segments, or half the target, tell the peer at once rather than
+ * leaving it to wait for our next ACK.
+ */
+static void receive_window_opened(mysocket_t sd, context_t *ctx)
+{
+	uint32_t opened;
+
+	assert(ctx);
+
+	update_receive_window(sd, ctx);
+	opened = ctx->receiver_next_seq + ctx->receiver_window_size - ctx->rcv_adv;
+
+	if (opened >= MIN(ctx->rcv_space_target / 2, 2 * ctx->rcv_mss))
+		ctx->ack_now = TRUE;
+}
+
+/* dynamic right-sizing: once a round trip has passed since the last
+ * measurement, see how much the application read in it.  if that is a
+ * record, let the window grow to twice as much, so the sender is never
+ * held back by it.
+ */
+static void rcv_space_adjust(context_t *ctx, uint32_t unread)
+{
+	uint64_t now = stcp_current_time();
+	tcp_seq copied_seq = ctx->receiver_next_seq - unread;
+	uint32_t rtt = ctx->rcv_rtt, copied;
+
+	if (ctx->rtt_valid && (!rtt || ctx->srtt < rtt))
+		rtt = ctx->srtt;
+
+	if (!rtt || now - ctx->rcv_space_time < rtt)
+		return;
+
+	copied = copied_seq - ctx->rcv_space_seq;
+	if (copied > ctx->rcv_space)
+	{
+		ctx->rcv_space = copied;
+		ctx->rcv_space_target = MAX(ctx->rcv_space_target,
+		                            MIN(2 * copied, ctx->rcv_window_clamp));
+	}
+
+	ctx->rcv_space_seq = copied_seq;
+	ctx->rcv_space_time = now;
+}
+
+/* sample the round trip from the receiver's side: the peer needs about one
+ * to send the data that fills the window we offered.  the estimate leans
+ * towards the smallest sample, as queueing only makes them larger.
+ */
+static void rcv_rtt_measure(context_t *ctx, uint64_t now)
+{
+	assert(ctx);
+
+	if (ctx->rcv_rtt_time && SEQ_GEQ(ctx->receiver_next_seq, ctx->rcv_rtt_seq))
+	{
+		uint32_t sample = (uint32_t)MIN(now - ctx->rcv_rtt_time,
+		                                (uint64_t)RTO_MAX);
+
+		sample = MAX(sample, 1);
+		if (!ctx->rcv_rtt || sample < ctx->rcv_rtt)
+			ctx->rcv_rtt = sample;
+		else
+			ctx->rcv_rtt = (7 * ctx->rcv_rtt + sample) / 8;
+
+		ctx->rcv_rtt_time = 0;
+	}
+
+	if (!ctx->rcv_rtt_time)
+	{
+		ctx->rcv_rtt_seq = ctx->receiver_next_seq +
+		                   MAX(ctx->receiver_window_size, ctx->rcv_mss);
+		ctx->rcv_rtt_time = now;
+	}
+}
+
+/* release acknowledged data from the send buffer and the retransmission
+ * queue, take an RTT sample, run congestion control and loss recovery,
+ * update the peer's window and advance the teardown states once our FIN
+ * has been acknowledged.
+ */
+static void process_ack(context_t *ctx, const STCPHeader *header,
+                        size_t data_len, uint64_t now)
+{
+	tcp_seq ack = ntohl(header->th_ack);
+	uint32_t window = ntohs(header->th_win);
+	uint64_t sample_time;
+	uint32_t acked, newly_sacked = 0, rtt = 0;
+	bool_t recovering = ctx->in_recovery;
+	tcp_options_t options;
+	rate_sample_t rs;
+	congestion_ack_t sample;
+
+	assert(ctx && header);
+
+	if (!(header->th_flags & TH_SYN))
+		window <<= ctx->snd_wscale;
+
+	/* ignore ACKs for data we haven't sent */
+	if (SEQ_LT(ack, ctx->sender_unack_seq) || SEQ_GT(ack, ctx->sender_next_seq))
+		return;
+
+	/* the peer is alive, whatever its window */
+	ctx->persist_probes = 0;
+
+	parse_options(header, &options);
+	memset(&rs, 0, sizeof(rs));
+	memset(&sample, 0, sizeof(sample));
+	sample.now = now;
+	sample.in_flight = bytes_in_flight(ctx);
+	sample.ack_seq = ack;
+
+	if (ack == ctx->sender_unack_seq)
+	{
+		if (ctx->sack_permitted)
+			newly_sacked = process_sack_blocks(ctx, &options, &rs, now);
+
+		/* a duplicate ACK reports a segment that arrived beyond a hole;
+		 * anything else is just a window update, or the answer to a
+		 * window probe.  the window is not required to be unchanged: the
+		 * peer's autotuning moves it while data is held out of order.
+		 * with SACK, a duplicate must carry new SACK information instead
+		 * (RFC 6675), which a window update never does.
+		 */
+		if (ctx->retransmit_head && data_len == 0 &&
+		    !(header->th_flags & TH_FIN) && window != 0 &&
+		    (!ctx->sack_permitted || newly_sacked > 0))
+			process_duplicate_ack(ctx, newly_sacked);
+
+		ctx->sender_window_size = window;
+
+		if (newly_sacked)
+		{
+			sample.sacked = newly_sacked;
+			sample.in_recovery = recovering || ctx->in_recovery;
+			congestion_on_ack(ctx, &sample, &rs);
+		}
+		return;
+	}
+
+	acked = ack - ctx->sender_unack_seq;
+	ctx->sender_unack_seq = ack;
+	ctx->sender_window_size = window;
+
+	sample_time = remove_acked_segments(ctx, ack, &rs, now);
+
+	if (ctx->sack_permitted)
+		newly_sacked = process_sack_blocks(ctx, &options, &rs, now);
+
+	rtt = ack_advanced(ctx, sample_time, now);
+
+	if (ctx->in_recovery)
+	{
+		if (SEQ_GEQ(ack, ctx->recover_seq))
+		{
+			/* everything outstanding at the loss has arrived */
+			ctx->in_recovery = FALSE;
+			ctx->dupacks = 0;
+			if (ctx->cc.ops->uses_prr)
+				ctx->cc.cwnd = ctx->cc.ssthresh;
+			if (ctx->probe_recovery)
+			{
+				ctx->probe_recovery = FALSE;
+				ctx->cc.ssthresh = ctx->probe_prior_ssthresh;
+			}
+		}
+		else
+		{
+			/* NewReno partial ACK: the next hole is lost as well */
+			ctx->dupacks = 0;
+			if (ctx->retransmit_head && !ctx->retransmit_head->sacked)
+				mark_lost(ctx, ctx->retransmit_head);
+			if (ctx->sack_permitted)
+				mark_sack_losses(ctx);
+			prr_update(ctx, acked + newly_sacked);
+		}
+	}
+	else if (ctx->sack_permitted && ctx->retransmit_head &&
+	         ctx->sacked_bytes > (DUPACK_THRESHOLD - 1) * ctx->mss)
+	{
+		/* the SACK scoreboard shows a hole even without three
+		 * duplicate ACKs in a row (RFC 6675)
+		 */
+		ctx->dupacks = 0;
+		enter_recovery(ctx);
+	}
+	else
+	{
+		ctx->dupacks = 0;
+	}
+
+	sample.acked = acked;
+	sample.sacked = newly_sacked;
+	sample.rtt = rtt;
+	sample.in_recovery = recovering || ctx->in_recovery;
+	congestion_on_ack(ctx, &sample, &rs);
+
+	if (ctx->fin_sent && ack == ctx->fin_seq + 1)
+		change_state(ctx, CEVENT_FIN_ACKED);
+}
+
+/* free the segments on the retransmission queue that ack covers, trimming
+ * one it covers only in part, and account for the data delivered.  returns
+ * when the newest of them that was sent only once went out, for an RTT
+ * sample, or 0 if there is none.
+ */
+static uint64_t remove_acked_segments(context_t *ctx, tcp_seq ack,
+                                      rate_sample_t *rs, uint64_t now)
+{
+	uint64_t sample_time = 0;
+
+	assert(ctx && rs);
+
+	while (ctx->retransmit_head)
+	{
+		segment_t *segment = ctx->retransmit_head;
+		tcp_seq end = segment->seq + SEGMENT_SEQ_LEN(segment);
+
+		if (SEQ_GT(end, ack))
+		{
+			/* partially acknowledged; keep only the unACKed tail */
+			if (SEQ_GT(ack, segment->seq))
+			{
+				if (segment->lost)
+					ctx->lost_bytes -= ack - segment->seq;
+				if (segment->sacked)
+					ctx->sacked_bytes -= ack - segment->seq;
+				else
+					ctx->delivered += ack - segment->seq;
+				segment->data_len -= ack - segment->seq;
+				segment->seq = ack;
+			}
+			break;
+		}
+
+		/* Karn's rule: a retransmitted segment gives no usable sample */
+		if (segment->transmissions == 1)
+			sample_time = segment->sent_time;
+
+		if (segment->lost)
+			ctx->lost_bytes -= SEGMENT_SEQ_LEN(segment);
+		if (segment->sacked)
+			ctx->sacked_bytes -= SEGMENT_SEQ_LEN(segment);
+		else
+			rate_on_delivered(ctx, rs, segment, now);
+		if (segment->probe)
+			mtu_probe_succeeded(ctx);
+
+		ctx->retransmit_head = segment->next;
+		release_segment(ctx, segment);
+	}
+	if (!ctx->retransmit_head)
+		ctx->retransmit_tail = NULL;
+
+	return sample_time;
+}
+
+/* the ACK made forward progress: take the RTT sample, if there is one, and
+ * restart the retransmission timer, or stop it if everything outstanding
+ * has now been acknowledged.  returns the sample (us), or 0.
+ */
+static uint32_t ack_advanced(context_t *ctx, uint64_t sample_time,
+                             uint64_t now)
+{
+	uint32_t rtt = 0;
+
+	assert(ctx);
+
+	if (sample_time && now > sample_time)
+	{
+		rtt = (uint32_t)(now - sample_time);
+		update_rto(ctx, rtt);
+	}
+
+	ctx->retransmit_count = 0;
+	ctx->rto_deadline = ctx->retransmit_head ? now + ctx->rto : 0;
+	return rtt;
+}
+
+/* count a duplicate ACK; the third (or, with SACK, enough selectively
+ * acknowledged data above the first hole) starts fast retransmit and
+ * recovery, and later ones let proportional rate reduction clock out more
+ * data.  newly_sacked is the data the ACK's SACK blocks reported for the
+ * first time.
+ */
+static void process_duplicate_ack(context_t *ctx, uint32_t newly_sacked)
+{
+	assert(ctx);
+
+	ctx->dupacks++;
+
+	if (ctx->in_recovery)
+	{
+		if (ctx->sack_permitted)
+		{
+			mark_sack_losses(ctx);
+			prr_update(ctx, newly_sacked);
+		}
+		else
+		{
+			prr_update(ctx, ctx->mss);
+		}
+	}
+	else if (ctx->dupacks == DUPACK_THRESHOLD ||
+	         (ctx->sack_permitted &&
+	          ctx->sacked_bytes > (DUPACK_THRESHOLD - 1) * ctx->mss))
+	{
+		enter_recovery(ctx);
+	}
+}
+
+/* record the segments covered by an ACK's SACK blocks on the scoreboard;
+ * returns the sequence space newly reported as received.
+ */
+static uint32_t process_sack_blocks(context_t *ctx,
+                                    const tcp_options_t *options,
+                                    rate_sample_t *rs, uint64_t now)
+{
+	uint32_t newly_sacked = 0;
+	int k;
+
+	assert(ctx && options);
+
+	for (k = 0; k < options->num_sack_blocks; ++k)
+	{
+		tcp_seq start = options->sack_start[k], end = options->sack_end[k];
+		segment_t *segment;
+
+		/* ignore blocks that don't describe outstanding data */
+		if (SEQ_LEQ(end, start) || SEQ_LT(start, ctx->sender_unack_seq) ||
+		    SEQ_GT(end, ctx->sender_next_seq))
+			continue;
+
+		for (segment = ctx->retransmit_head;
+		     segment && SEQ_LT(segment->seq, end);
+		     segment = segment->next)
+		{
+			if (segment->sacked || SEQ_LT(segment->seq, start) ||
+			    SEQ_GT(segment->seq + SEGMENT_SEQ_LEN(segment), end))
+				continue;
+
+			segment->sacked = TRUE;
+			ctx->sacked_bytes += SEGMENT_SEQ_LEN(segment);
+			newly_sacked += SEGMENT_SEQ_LEN(segment);
+			rate_on_delivered(ctx, rs, segment, now);
+			if (segment->probe)
+			{
+				segment->probe = FALSE;
+				mtu_probe_succeeded(ctx);
+			}
+
+			if (segment->lost)
+			{
+				/* it got through after all; don't resend it */
+				segment->lost = FALSE;
+				ctx->lost_bytes -= SEGMENT_SEQ_LEN(segment);
+			}
+		}
+	}
+
+	return newly_sacked;
+}
+
+/* record the connection's delivery state with a segment being sent, so its
+ * ACK can tell how fast data got through meanwhile
+ * (draft-cheng-iccrg-delivery-rate-estimation).  if nothing is in flight,
+ * a new sampling interval starts now.
+ */
+static void rate_on_send(context_t *ctx, segment_t *segment, uint64_t now)
+{
+	assert(ctx && segment);
+
+	if (ctx->sender_next_seq == ctx->sender_unack_seq ||
+	    bytes_in_flight(ctx) == 0)
+	{
+		ctx->first_sent_time = now;
+		ctx->delivered_time = now;
+	}
+
+	segment->delivered = ctx->delivered;
+	segment->delivered_time = ctx->delivered_time;
+	segment->first_sent_time = ctx->first_sent_time;
+	segment->app_limited = ctx->app_limited != 0;
+}
+
+/* count a segment the peer has received, and base the ACK's rate sample on
+ * it if it is the most recently sent one so far
+ */
+static void rate_on_delivered(context_t *ctx, rate_sample_t *rs,
+                              const segment_t *segment, uint64_t now)
+{
+	assert(ctx && rs && segment);
+
+	ctx->delivered += SEGMENT_SEQ_LEN(segment);
+	ctx->delivered_time = now;
+
+	if (!rs->valid || segment->delivered >= rs->prior_delivered)
+	{
+		rs->valid = TRUE;
+		rs->prior_delivered = segment->delivered;
+		rs->prior_time = segment->delivered_time;
+		rs->send_elapsed = segment->sent_time - segment->first_sent_time;
+		rs->app_limited = segment->app_limited;
+		ctx->first_sent_time = segment->sent_time;
+	}
+}
+
+/* complete the ACK's report with the delivery rate sample and hand it to
+ * the congestion control module.  the sample spans the longer of the send
+ * and ACK intervals, so neither bursty sending nor ACK compression inflates
+ * it.
+ */
+static void congestion_on_ack(context_t *ctx, congestion_ack_t *sample,
+                              const rate_sample_t *rs)
+{
+	assert(ctx && sample && rs);
+
+	if (ctx->app_limited && ctx->delivered > ctx->app_limited)
+		ctx->app_limited = 0;
+
+	sample->snd_nxt = ctx->sender_next_seq;
+	sample->delivered = ctx->delivered;
+
+	if (rs->valid)
+	{
+		uint64_t ack_elapsed = ctx->delivered_time - rs->prior_time;
+
+		sample->prior_delivered = rs->prior_delivered;
+		sample->rate_delivered = (uint32_t)(ctx->delivered - rs->prior_delivered);
+		sample->rate_interval = (uint32_t)MAX(rs->send_elapsed, ack_elapsed);
+		sample->rate_app_limited = rs->app_limited;
+	}
+
+	ctx->cc.ops->on_ack(&ctx->cc, sample);
+}
+
+/* RFC 6675 loss detection: a segment that hasn't been selectively
+ * acknowledged is lost once more than (DupThresh - 1) segments' worth of
+ * data above it has been.  segments already marked in this recovery
+ * episode are left alone, so a retransmission isn't immediately repeated.
+ */
+static void mark_sack_losses(context_t *ctx)
+{
+	uint32_t sacked_above = ctx->sacked_bytes;
+	segment_t *segment;
+
+	assert(ctx);
+
+	for (segment = ctx->retransmit_head;
+	     segment && sacked_above > (DUPACK_THRESHOLD - 1) * ctx->mss;
+	     segment = segment->next)
+	{
+		if (segment->sacked)
+			sacked_above -= SEGMENT_SEQ_LEN(segment);
+		else if (segment->loss_epoch != ctx->loss_epoch)
+			mark_lost(ctx, segment);
+	}
+}
+
+/* fast retransmit: mark the oldest segment lost, let the congestion control
+ * module pick the reduced window (ssthresh) and start a NewReno recovery
+ * phase that lasts until everything sent so far is
+ * acknowledged.  if the oldest segment is a path MTU probe, its loss is
+ * put down to its size rather than to congestion (RFC 4821, section 7.6.2)
+ * and the window is left as it is.
+ */
+static void enter_recovery(context_t *ctx)
+{
+	uint32_t flight;
+
+	assert(ctx && ctx->retransmit_head);
+
+	flight = ctx->sender_next_seq - ctx->sender_unack_seq;
+
+	if (ctx->retransmit_head->probe && !ctx->retransmit_head->sacked)
+	{
+		ctx->probe_recovery = TRUE;
+		ctx->probe_prior_ssthresh = ctx->cc.ssthresh;
+		ctx->cc.ssthresh = ctx->cc.cwnd;
+	}
+	else
+	{
+		ctx->cc.ops->on_loss(&ctx->cc, flight, stcp_current_time());
+	}
+	ctx->in_recovery = TRUE;
+	ctx->recover_seq = ctx->sender_next_seq;
+	ctx->recover_fs = flight;
+	ctx->prr_delivered = 0;
+	ctx->prr_out = 0;
+	ctx->loss_epoch++;
+
+	if (!ctx->retransmit_head->sacked)
+		mark_lost(ctx, ctx->retransmit_head);
+	if (ctx->sack_permitted)
+		mark_sack_losses(ctx);
+	prr_update(ctx, ctx->mss);
+
+	/* the fast retransmit itself always goes out */
+	ctx->cc.cwnd = MAX(ctx->cc.cwnd,
+	                bytes_in_flight(ctx) + ctx->retransmit_head->data_len);
+}
+
+/* proportional rate reduction (RFC 6937): spread the window reduction over
+ * the recovery round trip, sending in proportion to what the peer reports
+ * delivered.  without SACK a duplicate ACK counts as one segment delivered.
+ */
+static void prr_update(context_t *ctx, uint32_t delivered)
+{
+	uint32_t pipe = bytes_in_flight(ctx);
+	int64_t sndcnt;
+
+	assert(ctx && ctx->in_recovery);
+
+	ctx->prr_delivered += delivered;
+
+	/* other modules set the window during recovery themselves */
+	if (!ctx->cc.ops->uses_prr)
+		return;
+
+	if (pipe > ctx->cc.ssthresh)
+	{
+		uint64_t target = ((uint64_t)ctx->prr_delivered * ctx->cc.ssthresh +
+		                   ctx->recover_fs - 1) / MAX(ctx->recover_fs, 1);
+		sndcnt = (int64_t)target - ctx->prr_out;
+	}
+	else
+	{
+		/* slow start reduction bound: catch up towards ssthresh */
+		int64_t limit = MAX((int64_t)ctx->prr_delivered - ctx->prr_out,
+		                    (int64_t)delivered) + ctx->mss;
+		sndcnt = MIN((int64_t)(ctx->cc.ssthresh - pipe), limit);
+	}
+
+	ctx->cc.cwnd = pipe + (uint32_t)MAX(sndcnt, 0);
+}
+
+/* flag a segment for retransmission by send_pending_data() */
+static void mark_lost(context_t *ctx, segment_t *segment)
+{
+	assert(ctx && segment);
+
+	if (!segment->lost && !segment->sacked)
+	{
+		segment->lost = TRUE;
+		segment->loss_epoch = ctx->loss_epoch;
+		ctx->lost_bytes += SEGMENT_SEQ_LEN(segment);
+
+		if (segment->probe)
+			mtu_probe_failed(ctx, segment);
+	}
+}
+
+/* estimate of the bytes still in the network (RFC 6675 "pipe"): everything
+ * outstanding, less what is known to be lost and what has left the
+ * network.  with SACK the scoreboard says exactly what has arrived;
+ * without it, each duplicate ACK stands for one segment.
+ */
+static uint32_t bytes_in_flight(const context_t *ctx)
+{
+	uint32_t outstanding, departed;
+
+	assert(ctx);
+
+	outstanding = ctx->sender_next_seq - ctx->sender_unack_seq - ctx->lost_bytes;
+	departed = ctx->sack_permitted ? ctx->sacked_bytes
+	                               : ctx->dupacks * ctx->mss;
+	return (outstanding > departed) ? outstanding - departed : 0;
+}
+
+/* the peer's FIN arrived in sequence: it won't send any more data */
+static void process_fin(mysocket_t sd, context_t *ctx)
+{
+	assert(ctx);
+
+	ctx->receiver_next_seq++;
+	stcp_fin_received(sd);
+
+	/* from FIN_WAIT_2 this is the end, but the control loop still sends
+	 * the ACK of the FIN
+	 */
+	change_state(ctx, CEVENT_FIN);
+}
+
+/* fold a new round-trip sample into SRTT/RTTVAR and recompute the RTO
+ * (RFC 6298, section 2).
+ */
+static void update_rto(context_t *ctx, uint32_t rtt)
+{
+	uint32_t rto;
+
+	assert(ctx);
+
+	if (!ctx->rtt_valid)
+	{
+		ctx->srtt = rtt;
+		ctx->rttvar = rtt / 2;
+		ctx->rtt_valid = TRUE;
+	}
+	else
+	{
+		uint32_t delta = (ctx->srtt > rtt) ? ctx->srtt - rtt : rtt - ctx->srtt;
+
+		ctx->rttvar = (3 * ctx->rttvar + delta) / 4;
+		ctx->srtt = (7 * ctx->srtt + rtt) / 8;
+	}
+
+	rto = ctx->srtt + MAX(1, 4 * ctx->rttvar);
+	ctx->rto = MIN(MAX(rto, RTO_MIN), RTO_MAX);
+}
+
+/* the retransmission timer expired: everything still unacknowledged is
+ * presumed lost and resent from a one-segment window (RFC 5681, section
+ * 3.1), the timer is backed off, and the connection is given up once the
+ * same data has timed out too often.
+ */
+static void retransmit_timeout(mysocket_t sd, context_t *ctx)
+{
+	segment_t *segment;
+	uint64_t now = stcp_current_time();
+
+	assert(ctx);
+
+	if (!(segment = ctx->retransmit_head))
+	{
+		ctx->rto_deadline = 0;
+		return;
+	}
+
+	if (++ctx->retransmit_count > MAX_RETRANSMISSIONS)
+	{
+		connection_timed_out(sd, ctx);
+		return;
+	}
+
+	dprintf("retransmission timeout at seq %u, attempt %d\n",
+	        segment->seq, ctx->retransmit_count);
+
+	ctx->cc.ops->on_rto(&ctx->cc,
+	                    ctx->sender_next_seq - ctx->sender_unack_seq, now);
+	ctx->in_recovery = FALSE;
+	ctx->probe_recovery = FALSE;
+	ctx->dupacks = 0;
+	ctx->loss_epoch++;
+
+	/* data the peer has selectively acknowledged is not resent */
+	for (; segment; segment = segment->next)
+		mark_lost(ctx, segment);
+
+	ctx->rto = MIN(ctx->rto * 2, (uint32_t)RTO_MAX);
+	ctx->rto_deadline = now + ctx->rto;
+}
+
+/* start the persist timer once the peer's window has shut with data still
+ * to go, stopping the retransmission timer meanwhile, and stop it again as
+ * soon as the window opens
+ */
+static void update_persist_timer(context_t *ctx)
+{
+	assert(ctx);
+
+	if (ctx->sender_window_size > 0 ||
+	    !SEQ_LT(ctx->sender_unack_seq, ctx->send_buffer_end))
+	{
+		if (ctx->persist_deadline)
+		{
+			ctx->persist_deadline = 0;
+			ctx->persist_backoff = 0;
+			if (ctx->retransmit_head && !ctx->rto_deadline)
+				ctx->rto_deadline = stcp_current_time() + ctx->rto;
+		}
+		return;
+	}
+
+	ctx->rto_deadline = 0;
+	if (!ctx->persist_deadline)
+		ctx->persist_deadline = stcp_current_time() + persist_interval(ctx);
+}
+
+/* time to the next window probe: the RTO, doubled for each probe so far */
+static uint64_t persist_interval(const context_t *ctx)
+{
+	assert(ctx);
+
+	return MIN((uint64_t)ctx->rto << MIN(ctx->persist_backoff, 16),
+	           (uint64_t)PERSIST_MAX);
+}
+
+/* the persist timer expired: send a one-byte window probe, so that a lost
+ * window update can't leave both ends waiting for each other.  the byte is
+ * the first one the peer hasn't acknowledged or, with nothing in flight,
+ * the next new one, which then counts as sent.  a peer that stops
+ * answering probes altogether is given up on like one that stops
+ * acknowledging data.
+ */
+static void persist_timeout(mysocket_t sd, context_t *ctx)
+{
+	assert(ctx);
+
+	if (++ctx->persist_probes > MAX_RETRANSMISSIONS)
+	{
+		connection_timed_out(sd, ctx);
+		return;
+	}
+
+	dprintf("window probe at seq %u, attempt %d\n",
+	        ctx->sender_unack_seq, ctx->persist_probes);
+
+	if (SEQ_LT(ctx->sender_unack_seq, ctx->sender_next_seq))
+	{
+		send_segment(sd, ctx, ctx->sender_unack_seq, TH_ACK, 1);
+	}
+	else
+	{
+		send_new_segment(sd, ctx, ctx->sender_next_seq, TH_ACK, 1);
+		ctx->sender_next_seq++;
+	}
+
+	ctx->persist_backoff++;
+	ctx->persist_deadline = stcp_current_time() + persist_interval(ctx);
+}
+
+/* take up the socket options the data path and the keepalive timer act
+ * on, at the start and on every APP_OPTIONS_CHANGED, so the copies are
+ * never older than the wakeup that reports a change
+ */
+static void read_socket_options(mysocket_t sd, context_t *ctx)
+{
+	assert(ctx);
+
+	ctx->ack_delay = (uint64_t)stcp_get_option(sd, MYSO_ACK_DELAY) * 1000;
+	ctx->nodelay = stcp_get_option(sd, MYSO_NODELAY) != 0;
+	ctx->cork = stcp_get_option(sd, MYSO_CORK) != 0;
+	ctx->autocork = stcp_get_option(sd, MYSO_AUTOCORK) != 0;
+
+	if (!stcp_get_option(sd, MYSO_KEEPALIVE))
+	{
+		ctx->keepalive_idle = 0;
+		ctx->keepalive_deadline = 0;
+		return;
+	}
+
+	ctx->keepalive_idle = (uint64_t)stcp_get_option(sd, MYSO_KEEPIDLE) * 1000;
+	ctx->keepalive_intvl = (uint64_t)stcp_get_option(sd, MYSO_KEEPINTVL) * 1000;
+	ctx->keepalive_count = stcp_get_option(sd, MYSO_KEEPCNT);
+}
+
+/* run the keepalive timer only while the connection is idle.  with data
+ * outstanding the retransmission or persist timer finds out soon enough
+ * whether the peer is still there.
+ */
+static void update_keepalive_timer(context_t *ctx)
+{
+	assert(ctx);
+
+	if (!ctx->keepalive_idle ||
+	    SEQ_LT(ctx->sender_unack_seq, ctx->sender_next_seq) ||
+	    ctx->persist_deadline)
+	{
+		ctx->keepalive_deadline = 0;
+		ctx->keepalive_probes = 0;
+		return;
+	}
+
+	/* once probing, keepalive_timeout() schedules the next probe */
+	if (!ctx->keepalive_probes)
+		ctx->keepalive_deadline = ctx->last_heard + ctx->keepalive_idle;
+}
+
+/* the keepalive timer expired: send a probe the peer has to acknowledge,
+ * an empty segment one below the next sequence number, or give up on the
+ * peer if the last keepalive_count probes went unanswered
+ */
+static void keepalive_timeout(mysocket_t sd, context_t *ctx)
+{
+	assert(ctx);
+
+	if (ctx->keepalive_probes >= ctx->keepalive_count)
+	{
+		connection_timed_out(sd, ctx);
+		return;
+	}
+
+	ctx->keepalive_probes++;
+	dprintf("keepalive probe %d\n", ctx->keepalive_probes);
+
+	send_segment(sd, ctx, ctx->sender_next_seq - 1, TH_ACK, 0);
+	ctx->keepalive_deadline = stcp_current_time() + ctx->keepalive_intvl;
+}
+
+/* abandon a connection whose peer has stopped responding */
+static void connection_timed_out(mysocket_t sd, context_t *ctx)
+{
+	assert(ctx);
+
+	errno = ETIMEDOUT;
+	stcp_abort_connection(sd);
+	change_state(ctx, CEVENT_ABORT);
+}
+
+/* move the connection on from its current state on event, as
+ * state_transitions says.  it is done once it reaches TIME_WAIT or CLOSED.
+ */
+static void change_state(context_t *ctx, int event)
+{
+	int next;
+
+	assert(ctx);
+	assert(ctx->connection_state >= 0 && ctx->connection_state < NUM_CSTATES);
+	assert(event >= 0 && event < NUM_CEVENTS);
+
+	next = state_transitions[ctx->connection_state][event];
+	assert(next != NO_TRANSITION);
+
+	ctx->connection_state = next;
+	if (next == CSTATE_TIME_WAIT || next == CSTATE_CLOSED)
+		ctx->done = TRUE;
+}
+
+static void free_retransmit_queue(context_t *ctx)
+{
+	assert(ctx);
+
+	while (ctx->retransmit_head)
+	{
+		segment_t *next = ctx->retransmit_head->next;
+		release_segment(ctx, ctx->retransmit_head);
+		ctx->retransmit_head = next;
+	}
+	ctx->retransmit_tail = NULL;
+}
+
+/* add at least count segments to the free pool, a block at a time.  the
+ * initial pool covers a send buffer's worth of MSS-sized segments; only a
+ * sender writing smaller ones with Nagle off can run it dry, and then it
+ * grows by a block, which stays in the pool until the connection ends.
+ */
+static void grow_segment_pool(context_t *ctx, size_t count)
+{
+	assert(ctx);
+
+	while (count > 0)
+	{
+		segment_block_t *block;
+		int k;
+
+		block = (segment_block_t *)malloc(sizeof(segment_block_t));
+		assert(block);
+
+		block->next = ctx->segment_blocks;
+		ctx->segment_blocks = block;
+
+		for (k = SEGMENT_BLOCK_LEN - 1; k >= 0; --k)
+			release_segment(ctx, &block->segments[k]);
+
+		count -= MIN(count, (size_t)SEGMENT_BLOCK_LEN);
+	}
+}
+
+/* take a segment from the pool.  its contents are undefined. */
+static segment_t *alloc_segment(context_t *ctx)
+{
+	segment_t *segment;
+
+	assert(ctx);
+
+	if (!ctx->free_segments)
+		grow_segment_pool(ctx, SEGMENT_BLOCK_LEN);
+
+	segment = ctx->free_segments;
+	ctx->free_segments = segment->next;
+	return segment;
+}
+
+static void release_segment(context_t *ctx, segment_t *segment)
+{
+	assert(ctx && segment);
+
+	segment->next = ctx->free_segments;
+	ctx->free_segments = segment;
+}
+
+static void free_segment_pool(context_t *ctx)
+{
+	assert(ctx);
+
+	while (ctx->segment_blocks)
+	{
+		segment_block_t *next = ctx->segment_blocks->next;
+		free(ctx->segment_blocks);
+		ctx->segment_blocks = next;
+	}
+	ctx->free_segments = NULL;
 }
 
 /**********************************************************************/
@@ -73,7 +73,9 @@ typedef struct tcphdr
 /* length of options (in bytes) in TCP packet p */
 #define TCP_OPTIONS_LEN(p) (TCP_DATA_START(p) - sizeof(struct tcphdr))
 
-/* STCP maximum segment size */
+/* STCP maximum segment size, unless both ends agree on a larger one with
+ * the MSS option (this is also what is assumed for a peer that sends none)
+ */
 #define STCP_MSS 536
 
 
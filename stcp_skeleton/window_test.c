@@ -0,0 +1,267 @@
+/*
+ * window_test.c
+ *
+ * Checks that a mysocket survives a peer that sends data beyond the
+ * window it was offered.  The peer is faked here: it speaks the TCP
+ * network layer's framing (a 2-byte length, then the segment) directly,
+ * so it can put segments anywhere in sequence space.  The segments beyond
+ * the window must each be acknowledged at once without being delivered,
+ * and the data sent in order afterwards must reach myread() intact.
+ *
+ * Exits with status 0 if all is well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "transport.h"
+#include "tcp_sum.h"
+
+
+#define PEER_ISN    1000
+#define ACK_WAIT_MS 2000
+
+typedef struct
+{
+    uint16_t port;          /* network byte order */
+    int fd;
+    tcp_seq isn;            /* the mysocket's */
+} peer_t;
+
+static void *run_peer(void *arg);
+static void send_segment(peer_t *peer, tcp_seq seq, uint8_t flags,
+                         const char *data, size_t len);
+static void recv_segment(peer_t *peer, STCPHeader *header, size_t max_len);
+static void read_fully(peer_t *peer, void *buf, size_t len);
+static void expect_ack(peer_t *peer, tcp_seq ack, uint16_t *window);
+static void fail(const char *fmt, ...);
+
+static char usage[] = "usage: %s\n";
+
+/**********************************************************************/
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    mysocket_t bindsd, sd;
+    pthread_t peer_thread;
+    peer_t peer;
+    char buf[16];
+    int len, total = 0;
+
+    if (argc != 1)
+    {
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((bindsd = mysocket()) < 0)
+    {
+        perror("mysocket");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(0);
+    len = sizeof(struct sockaddr_in);
+
+    if (mybind(bindsd, (struct sockaddr *) &sin, len) < 0 ||
+        mylisten(bindsd, 5) < 0 ||
+        mygetsockname(bindsd, (struct sockaddr *) &sin, &sin_len) < 0)
+    {
+        perror("mybind/mylisten");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&peer, 0, sizeof(peer));
+    peer.port = sin.sin_port;
+    peer.fd = -1;
+    if (pthread_create(&peer_thread, NULL, run_peer, &peer) != 0)
+        fail("pthread_create failed\n");
+
+    if ((sd = myaccept(bindsd, (struct sockaddr *) &sin, &len)) < 0)
+    {
+        perror("myaccept");
+        exit(EXIT_FAILURE);
+    }
+
+    /* only the in-order bytes may arrive, however they are split up */
+    while (total < 3)
+    {
+        if ((len = myread(sd, buf + total, sizeof(buf) - total)) <= 0)
+            fail("myread returned %d after %d bytes\n", len, total);
+        total += len;
+    }
+    if (total != 3 || memcmp(buf, "abc", 3) != 0)
+        fail("read %d bytes, \"%.*s\", expected \"abc\"\n", total, total, buf);
+
+    pthread_join(peer_thread, NULL);
+    printf("window_test: ok\n");
+    return 0;
+}
+
+
+/* the fake peer: open the connection, find the right edge of the window
+ * from the mysocket's first ACK, then send data at and well past it
+ * before completing the stream in order
+ */
+static void *run_peer(void *arg)
+{
+    peer_t *peer = (peer_t *) arg;
+    struct sockaddr_in sin;
+    uint32_t buf[16];
+    STCPHeader *header = (STCPHeader *) buf;
+    tcp_seq next = PEER_ISN + 1, edge;
+    uint16_t window;
+    char junk[100];
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = peer->port;
+
+    if ((peer->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        connect(peer->fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+        fail("connect: %s\n", strerror(errno));
+
+    /* the handshake, without options */
+    send_segment(peer, PEER_ISN, TH_SYN, NULL, 0);
+    recv_segment(peer, header, sizeof(buf));
+    if (header->th_flags != (TH_SYN | TH_ACK) ||
+        ntohl(header->th_ack) != next)
+        fail("expected a SYN-ACK for %u\n", (unsigned) next);
+    peer->isn = ntohl(header->th_seq);
+    send_segment(peer, next, TH_ACK, NULL, 0);
+
+    /* one in-order byte; its ACK gives the offered window */
+    send_segment(peer, next, TH_ACK, "a", 1);
+    ++next;
+    expect_ack(peer, next, &window);
+    edge = next + window;
+
+    memset(junk, 'x', sizeof(junk));
+
+    /* starting at the right edge, and far beyond it */
+    send_segment(peer, edge, TH_ACK, junk, sizeof(junk));
+    expect_ack(peer, next, NULL);
+    send_segment(peer, edge + 1000000, TH_ACK | TH_FIN, junk, sizeof(junk));
+    expect_ack(peer, next, NULL);
+
+    /* the connection still works */
+    send_segment(peer, next, TH_ACK, "bc", 2);
+    next += 2;
+    expect_ack(peer, next, NULL);
+    return NULL;
+}
+
+/* frame and send a segment, checksummed as the network layer would */
+static void send_segment(peer_t *peer, tcp_seq seq, uint8_t flags,
+                         const char *data, size_t len)
+{
+    uint32_t buf[(sizeof(uint16_t) + sizeof(STCPHeader) + 128) /
+                 sizeof(uint32_t) + 1];
+    uint16_t frame_len = htons(sizeof(STCPHeader) + len);
+    STCPHeader *header = (STCPHeader *) (buf + 1);
+    uint32_t loopback = htonl(INADDR_LOOPBACK);
+
+    assert(len <= 128);
+
+    memset(buf, 0, sizeof(buf));
+    header->th_seq = htonl(seq);
+    header->th_ack = htonl(peer->isn + 1);
+    header->th_off = 5;
+    header->th_flags = flags;
+    header->th_win = htons(65535);
+    if (len > 0)
+        memcpy(header + 1, data, len);
+    header->th_sum = _mysock_tcp_checksum(loopback, mylocalip(loopback),
+                                          header, sizeof(STCPHeader) + len);
+
+    /* the length sits just before the header */
+    memcpy((uint8_t *) header - sizeof(frame_len), &frame_len,
+           sizeof(frame_len));
+    if (write(peer->fd, (uint8_t *) header - sizeof(frame_len),
+              sizeof(frame_len) + sizeof(STCPHeader) + len) !=
+        (ssize_t) (sizeof(frame_len) + sizeof(STCPHeader) + len))
+        fail("write: %s\n", strerror(errno));
+}
+
+/* read exactly len bytes, failing if the mysocket goes quiet for
+ * ACK_WAIT_MS
+ */
+static void read_fully(peer_t *peer, void *buf, size_t len)
+{
+    struct pollfd pfd;
+    ssize_t rc;
+
+    for (; len > 0; len -= rc, buf = (uint8_t *) buf + rc)
+    {
+        pfd.fd = peer->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, ACK_WAIT_MS) <= 0)
+            fail("no segment from the mysocket\n");
+        if ((rc = read(peer->fd, buf, len)) <= 0)
+            fail("the mysocket closed the connection\n");
+    }
+}
+
+static void recv_segment(peer_t *peer, STCPHeader *header, size_t max_len)
+{
+    uint16_t frame_len;
+
+    read_fully(peer, &frame_len, sizeof(frame_len));
+    frame_len = ntohs(frame_len);
+    if (frame_len < sizeof(STCPHeader) || frame_len > max_len)
+        fail("bad segment length %u\n", (unsigned) frame_len);
+    read_fully(peer, header, frame_len);
+}
+
+/* wait for a segment acknowledging exactly ack, and note its window.
+ * window updates for earlier data may still be on their way, and are
+ * passed over.
+ */
+static void expect_ack(peer_t *peer, tcp_seq ack, uint16_t *window)
+{
+    uint32_t buf[(sizeof(STCPHeader) + 64) / sizeof(uint32_t)];
+    STCPHeader *header = (STCPHeader *) buf;
+
+    do
+    {
+        recv_segment(peer, header, sizeof(buf));
+        if (!(header->th_flags & TH_ACK))
+            fail("expected an ACK, got flags %#x\n", header->th_flags);
+    } while ((int32_t) (ntohl(header->th_ack) - ack) < 0);
+
+    if (ntohl(header->th_ack) != ack)
+        fail("expected an ACK for %u, got %u\n", (unsigned) ack,
+             (unsigned) ntohl(header->th_ack));
+    if (window)
+        *window = ntohs(header->th_win);
+}
+
+static void fail(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    fprintf(stderr, "window_test: ");
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    exit(EXIT_FAILURE);
+}